@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "agent.h"
+
+/*****************************************************
+* Agent listener of a manager, and its connections to the
+* agents of other hosts
+* Author: Gloire Rubambiza
+* Version: 10/31/2017
+******************************************************/
+
+/**
+ * Opens the agent's listener on the given port
+ * @param port the port to listen on
+ * @param bind_addr the IPv4 address to bind, NULL for loopback
+ * @return the listening descriptor, -1 on error
+ */
+int agent_listen ( int port, const char* bind_addr ){
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ( bind_addr != NULL &&
+       inet_pton(AF_INET, bind_addr, &addr.sin_addr) != 1){
+    return -1;
+  }
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if ( fd < 0){
+    return -1;
+  }
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if ( bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+       listen(fd, MAX_AGENT_CLIENTS) < 0){
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Accepts a connection into a free client
+ * Output is written blocking, with a timeout so a stalled controller
+ * cannot hold up the manager for long.
+ * @param listen_fd the agent's listener
+ * @param clients MAX_AGENT_CLIENTS clients
+ * @return 0 on success, -1 when none is free or accept failed
+ */
+int agent_accept ( int listen_fd, AgentClient clients[] ){
+  int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if ( conn < 0){
+    return -1;
+  }
+  int i;
+  for ( i = 0; i < MAX_AGENT_CLIENTS; ++i){
+    if ( clients[i].fd < 0){
+      struct timeval timeout = { .tv_sec = NODE_TIMEOUT, .tv_usec = 0 };
+      setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+      clients[i].fd = conn;
+      clients[i].len = 0;
+      return 0;
+    }
+  }
+  close(conn); // The controller sees the hang up and may retry later
+  return -1;
+}
+
+/**
+ * Closes a client's connection
+ * @param client the client
+ */
+void agent_close ( AgentClient* client ){
+  if ( client->fd >= 0){
+    close(client->fd);
+  }
+  client->fd = -1;
+  client->len = 0;
+}
+
+/**
+ * Reads what a client sent and runs every complete line, each answered
+ * with its output and the end mark. A line too long for the buffer is
+ * not a command we know, so it is dropped.
+ * @param client the client
+ * @param handler runs the command lines
+ * @param ctx passed to handler
+ * @return 0 while the client is connected, -1 once it closed
+ */
+int agent_read ( AgentClient* client, AgentHandler handler, void* ctx ){
+  ssize_t n = recv(client->fd, client->buf + client->len,
+                   sizeof(client->buf) - 1 - client->len, MSG_DONTWAIT);
+  if ( n < 0 && (errno == EAGAIN || errno == EINTR)){
+    return 0;
+  }
+  if ( n <= 0){
+    agent_close(client);
+    return -1;
+  }
+  client->len += n;
+  client->buf[client->len] = '\0';
+
+  char* line = client->buf, *end;
+  while ( (end = strchr(line, '\n')) != NULL){
+    *end = '\0';
+    bool hang_up = false;
+    char mark[32];
+    int len = snprintf(mark, sizeof(mark), "%s %d\n", AGENT_END_MARK,
+                       handler(line, client->fd, &hang_up, ctx));
+    if ( send(client->fd, mark, len, MSG_NOSIGNAL) < 0 || hang_up){
+      agent_close(client);
+      return -1;
+    }
+    line = end + 1;
+  }
+  client->len -= line - client->buf;
+  memmove(client->buf, line, client->len);
+  if ( client->len == sizeof(client->buf) - 1){
+    client->len = 0;
+  }
+  return 0;
+}
+
+/**
+ * Connects to a node's agent, unless it already is
+ * @param node the node
+ * @return 0 on success, -1 on error
+ */
+int node_connect ( Node* node ){
+  if ( node->fd >= 0){
+    return 0;
+  }
+  struct addrinfo hints, *addrs, *addr;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ( getaddrinfo(node->host, node->port, &hints, &addrs) != 0){
+    return -1;
+  }
+  struct timeval timeout = { .tv_sec = NODE_TIMEOUT, .tv_usec = 0 };
+  for ( addr = addrs; addr != NULL; addr = addr->ai_next){
+    int fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC,
+                    addr->ai_protocol);
+    if ( fd < 0){
+      continue;
+    }
+    // Bounds connect() as well as every read and write after it
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if ( connect(fd, addr->ai_addr, addr->ai_addrlen) == 0){
+      node->fd = fd;
+      break;
+    }
+    close(fd);
+  }
+  freeaddrinfo(addrs);
+  node->len = 0;
+  return node->fd >= 0 ? 0 : -1;
+}
+
+/**
+ * Disconnects from a node
+ * @param node the node
+ */
+void node_close ( Node* node ){
+  if ( node->fd >= 0){
+    close(node->fd);
+  }
+  node->fd = -1;
+  node->len = 0;
+}
+
+/**
+ * Writes all of a buffer to a node
+ * @return 0 on success, -1 on error
+ */
+static int send_all ( Node* node, const char* data, size_t len ){
+  while ( len > 0){
+    ssize_t n = send(node->fd, data, len, MSG_NOSIGNAL);
+    if ( n < 0 && errno == EINTR){
+      continue;
+    }
+    if ( n <= 0){
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/**
+ * Sends a batch of command lines to a node, reconnecting once if needed
+ * A connection the agent dropped while idle only shows on the first
+ * write, which is then retried on a fresh one.
+ * @param node the node
+ * @param lines the commands, each ending with a newline
+ * @param len the length of lines
+ * @return 0 on success, -1 on error
+ */
+int node_send ( Node* node, const char* lines, size_t len ){
+  int attempt;
+  for ( attempt = 0; attempt < 2; ++attempt){
+    if ( node_connect(node) < 0){
+      return -1;
+    }
+    char probe;
+    if ( recv(node->fd, &probe, 1, MSG_DONTWAIT | MSG_PEEK) == 0 ||
+         send_all(node, lines, len) < 0){
+      node_close(node);
+      continue;
+    }
+    return 0;
+  }
+  return -1;
+}
+
+/**
+ * Tells whether a line is an end mark, and the status it carries
+ * @param line the line, without its newline
+ * @param status receives the status
+ * @return true for an end mark
+ */
+static bool end_mark ( const char* line, int* status ){
+  size_t len = sizeof(AGENT_END_MARK) - 1;
+  if ( strncmp(line, AGENT_END_MARK, len) != 0 ||
+       (line[len] != '\0' && line[len] != ' ')){
+    return false;
+  }
+  *status = atoi(line + len);
+  return true;
+}
+
+/**
+ * Reads a node's replies until it answered the given number of commands
+ * @param node the node
+ * @param replies the number of commands sent
+ * @param fn receives every line of output, without its newline
+ * @param ctx passed to fn
+ * @return the number of commands that failed, -1 if the node timed out
+ *         or hung up
+ */
+int node_receive ( Node* node, int replies, NodeLineFn fn, void* ctx ){
+  int failed = 0, status;
+  while ( replies > 0){
+    char* line = node->buf, *end;
+    while ( replies > 0 && (end = memchr(line, '\n',
+                                         node->buf + node->len - line)) != NULL){
+      *end = '\0';
+      if ( end_mark(line, &status)){
+        replies--;
+        failed += status != 0;
+      } else {
+        fn(node, line, ctx);
+      }
+      line = end + 1;
+    }
+    node->len -= line - node->buf;
+    memmove(node->buf, line, node->len);
+    if ( replies == 0){
+      break;
+    }
+    if ( node->len == sizeof(node->buf) - 1){ // A line longer than we keep
+      node->buf[node->len] = '\0';
+      fn(node, node->buf, ctx);
+      node->len = 0;
+    }
+
+    ssize_t n = recv(node->fd, node->buf + node->len,
+                     sizeof(node->buf) - 1 - node->len, 0);
+    if ( n < 0 && errno == EINTR){
+      continue;
+    }
+    if ( n <= 0){
+      node_close(node);
+      return -1;
+    }
+    node->len += n;
+  }
+  return failed;
+}
@@ -0,0 +1,111 @@
+#ifndef H_AGENT
+#define H_AGENT
+#include <stdbool.h>
+#include <stddef.h>
+
+/***********************************************
+* Remote control of managers on other hosts
+* A manager started with SCS_AGENT_PORT also acts as the
+* agent of its host: it accepts TCP connections and runs the
+* command lines it reads on them as if they were typed at its
+* prompt, answering each with its output and AGENT_END_MARK
+* followed by the command's status, 0 when it succeeded.
+* Another manager registers agents as nodes and sends them
+* batches of commands, all nodes first, then collects replies.
+* Author: Gloire Rubambiza
+* Version: 10/30/2017
+***********************************************/
+
+// Environment variables enabling the agent and choosing its address.
+// Commands are not authenticated, so it only binds loopback by default.
+#define AGENT_PORT_ENV "SCS_AGENT_PORT"
+#define AGENT_BIND_ENV "SCS_AGENT_BIND"
+
+// Ends the output of every command, on a line of its own as in "%%end -1"
+#define AGENT_END_MARK "%%end"
+
+#define AGENT_LINE_SIZE 4096
+#define MAX_AGENT_CLIENTS 8
+#define MAX_NODES 16
+
+// Seconds a node may take to answer a batch before it counts as down
+#define NODE_TIMEOUT 5
+
+// A connection to our agent, and the command line being read from it
+typedef struct AgentClient {
+  int fd;                              // -1 when unused
+  char buf[AGENT_LINE_SIZE];
+  size_t len;
+} AgentClient;
+
+// Runs one command line read by the agent, its output goes to client_fd.
+// Returns the command's status, and sets hang_up to end the session once
+// its output is sent.
+typedef int (*AgentHandler) ( char* line, int client_fd, bool* hang_up,
+                              void* ctx );
+
+// Another host's agent, as registered with addNode
+typedef struct Node {
+  char* name;                          // NULL when unused
+  char* host;
+  char* port;
+  int fd;                              // -1 until connected
+  char buf[AGENT_LINE_SIZE];           // Reply bytes not yet split in lines
+  size_t len;
+} Node;
+
+// Receives every line of a node's replies
+typedef void (*NodeLineFn) ( Node* node, const char* line, void* ctx );
+
+/**
+ * Opens the agent's listener on the given port
+ * @param bind_addr the IPv4 address to bind, NULL for loopback
+ * @return the listening descriptor, -1 on error
+ */
+int agent_listen ( int port, const char* bind_addr );
+
+/**
+ * Accepts a connection into a free client
+ * @return 0 on success, -1 when none is free or accept failed
+ */
+int agent_accept ( int listen_fd, AgentClient clients[] );
+
+/**
+ * Reads what a client sent and runs every complete line
+ * @return 0 while the client is connected, -1 once it closed
+ */
+int agent_read ( AgentClient* client, AgentHandler handler, void* ctx );
+
+/**
+ * Closes a client's connection
+ */
+void agent_close ( AgentClient* client );
+
+/**
+ * Connects to a node's agent, unless it already is
+ * @return 0 on success, -1 on error
+ */
+int node_connect ( Node* node );
+
+/**
+ * Sends a batch of command lines to a node, reconnecting once if needed
+ * @param lines the commands, each ending with a newline
+ * @return 0 on success, -1 on error
+ */
+int node_send ( Node* node, const char* lines, size_t len );
+
+/**
+ * Reads a node's replies until it answered the given number of commands
+ * @param replies the number of commands sent
+ * @param fn receives every line of output, without its newline
+ * @return the number of commands that failed, -1 if the node timed out
+ *         or hung up
+ */
+int node_receive ( Node* node, int replies, NodeLineFn fn, void* ctx );
+
+/**
+ * Disconnects from a node
+ */
+void node_close ( Node* node );
+
+#endif
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "coroutine.h"
+
+/*****************************************************
+* Scheduler of the coroutines running a replica's jobs
+* A coroutine only gives up control while its I/O is in
+* flight, the replica's loop resumes it once that completes.
+* Author: Gloire Rubambiza
+* Version: 10/26/2017
+******************************************************/
+
+// Scheduler of the calling thread, so jobs can yield without a handle
+static __thread Scheduler* current_scheduler = NULL;
+
+/**
+ * Prepares a scheduler running at most cap coroutines at once
+ * Coroutines and their stacks are only allocated once needed.
+ * @param sched the scheduler to prepare
+ * @param cap the most coroutines in flight
+ * @param loop carries out the coroutines' I/O
+ * @return 0 on success, -1 on error
+ */
+int sched_init ( Scheduler* sched, int cap, IoLoop* loop ){
+  memset(sched, 0, sizeof(Scheduler));
+  sched->coroutines = calloc(cap, sizeof(Coroutine*));
+  if ( sched->coroutines == NULL){
+    return -1;
+  }
+  sched->cap = cap;
+  sched->loop = loop;
+  current_scheduler = sched;
+  return 0;
+}
+
+/**
+ * Maps a coroutine stack with a guard page below it
+ * @return the usable bottom of the stack, NULL on error
+ */
+static char* map_stack (){
+  long page = sysconf(_SC_PAGESIZE);
+  char* stack = mmap(NULL, COROUTINE_STACK_SIZE + page, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE,
+                     -1, 0);
+  if ( stack == MAP_FAILED){
+    return NULL;
+  }
+  mprotect(stack, page, PROT_NONE); // Overflowing faults instead of corrupting
+  return stack + page;
+}
+
+/**
+ * Frees the coroutines of a scheduler and unmaps their stacks
+ * Coroutines still suspended are dropped without running further, so
+ * their operations must no longer be in flight on the loop.
+ * @param sched the scheduler, prepared again before any further use
+ */
+void sched_destroy ( Scheduler* sched ){
+  long page = sysconf(_SC_PAGESIZE);
+  int i;
+  for ( i = 0; sched->coroutines != NULL && i < sched->cap; ++i){
+    Coroutine* co = sched->coroutines[i];
+    if ( co != NULL){
+      munmap(co->stack - page, COROUTINE_STACK_SIZE + page);
+      free(co);
+    }
+  }
+  free(sched->coroutines);
+  if ( current_scheduler == sched){
+    current_scheduler = NULL;
+  }
+  memset(sched, 0, sizeof(Scheduler));
+}
+
+/**
+ * Runs the job of the current coroutine, then falls back to the
+ * scheduler through uc_link
+ */
+static void coroutine_main (){
+  Scheduler* sched = current_scheduler;
+  Coroutine* co = sched->current;
+  co->fn(co->arg);
+  co->running = false;
+  sched->active--;
+}
+
+/**
+ * Switches to a coroutine until it waits or finishes
+ */
+static void resume ( Scheduler* sched, Coroutine* co ){
+  sched->current = co;
+  swapcontext(&sched->context, &co->context);
+  sched->current = NULL;
+}
+
+/**
+ * Starts a coroutine and runs it until it first blocks or finishes
+ * @param sched the scheduler of the calling thread
+ * @param fn the job to run
+ * @param arg passed to fn
+ * @return 0 on success, -1 when at the cap or out of memory
+ */
+int co_spawn ( Scheduler* sched, CoroutineFn fn, void* arg ){
+  int i;
+  for ( i = 0; i < sched->cap; ++i){
+    if ( sched->coroutines[i] == NULL || !sched->coroutines[i]->running){
+      break;
+    }
+  }
+  if ( i == sched->cap){
+    return -1;
+  }
+  Coroutine* co = sched->coroutines[i];
+  if ( co == NULL){
+    co = calloc(1, sizeof(Coroutine));
+    if ( co == NULL || (co->stack = map_stack()) == NULL){
+      free(co);
+      return -1;
+    }
+    sched->coroutines[i] = co;
+  }
+
+  getcontext(&co->context);
+  co->context.uc_stack.ss_sp = co->stack;
+  co->context.uc_stack.ss_size = COROUTINE_STACK_SIZE;
+  co->context.uc_link = &sched->context;
+  makecontext(&co->context, coroutine_main, 0);
+  co->fn = fn;
+  co->arg = arg;
+  co->running = true;
+  sched->active++;
+  resume(sched, co);
+  return 0;
+}
+
+/**
+ * Resumes the coroutine that owns a completed operation
+ * @param sched the scheduler
+ * @param op an operation returned by ioloop_wait()
+ * @return false when the operation is not a coroutine's
+ */
+bool sched_complete ( Scheduler* sched, IoOp* op ){
+  if ( op->owner == NULL){
+    return false;
+  }
+  resume(sched, op->owner);
+  return true;
+}
+
+/**
+ * Suspends the current coroutine until its operation completes
+ * @return what the operation returned, with errno set on error
+ */
+static ssize_t co_io ( Scheduler* sched, IoKind kind, int fd, void* buf,
+                       size_t len ){
+  Coroutine* co = sched->current;
+  co->op = (IoOp) { .kind = kind, .fd = fd, .buf = buf, .len = len,
+                    .owner = co };
+  int error = ioloop_submit(sched->loop, &co->op);
+  if ( error == 0){
+    swapcontext(&co->context, &sched->context);
+    error = co->op.result;
+  }
+  if ( error < 0){
+    errno = -error;
+    return -1;
+  }
+  return error;
+}
+
+/**
+ * Reads from a descriptor, yielding until the read completes
+ * Outside of a coroutine it is a plain read().
+ * @return what read() would have returned
+ */
+ssize_t co_read ( int fd, void* buf, size_t len ){
+  Scheduler* sched = current_scheduler;
+  if ( sched == NULL || sched->current == NULL){
+    return read(fd, buf, len);
+  }
+  return co_io(sched, IO_READ, fd, buf, len);
+}
+
+/**
+ * Writes all of buf to a descriptor, yielding until it is written
+ * @return len on success, -1 on error
+ */
+ssize_t co_write ( int fd, const void* buf, size_t len ){
+  Scheduler* sched = current_scheduler;
+  size_t done = 0;
+  while ( done < len){
+    ssize_t n;
+    if ( sched == NULL || sched->current == NULL){
+      n = write(fd, (const char*) buf + done, len - done);
+    } else {
+      n = co_io(sched, IO_WRITE, fd, (char*) buf + done, len - done);
+    }
+    if ( n < 0){
+      return -1;
+    }
+    done += n;
+  }
+  return len;
+}
@@ -0,0 +1,74 @@
+#ifndef H_COROUTINE
+#define H_COROUTINE
+#include <stdbool.h>
+#include <sys/types.h>
+#include <ucontext.h>
+#include "ioloop.h"
+
+/***********************************************
+* Stackful coroutines multiplexing jobs inside a replica
+* Every job runs on its own small stack and yields to the
+* scheduler while its I/O is in flight on the replica's loop,
+* so a replica keeps many jobs going at once. Schedulers are
+* per thread, thread-mode replicas each run their own.
+* Author: Gloire Rubambiza
+* Version: 10/26/2017
+***********************************************/
+
+#define COROUTINE_STACK_SIZE (64 * 1024)
+
+typedef void (*CoroutineFn) (void* arg);
+
+typedef struct Coroutine {
+  ucontext_t context;
+  char* stack;                         // Kept once finished, for the next job
+  CoroutineFn fn;
+  void* arg;
+  IoOp op;                             // The I/O it is suspended on
+  bool running;
+} Coroutine;
+
+typedef struct Scheduler {
+  ucontext_t context;                  // Where coroutines yield back to
+  Coroutine** coroutines;              // cap entries, allocated on first use
+  Coroutine* current;                  // NULL while the scheduler runs
+  IoLoop* loop;                        // Carries out the coroutines' I/O
+  int cap;
+  int active;
+} Scheduler;
+
+/**
+ * Prepares a scheduler running at most cap coroutines at once
+ * @return 0 on success, -1 on error
+ */
+int sched_init ( Scheduler* sched, int cap, IoLoop* loop );
+
+/**
+ * Frees the coroutines of a scheduler and unmaps their stacks
+ */
+void sched_destroy ( Scheduler* sched );
+
+/**
+ * Starts a coroutine and runs it until it first blocks or finishes
+ * @return 0 on success, -1 when at the cap or out of memory
+ */
+int co_spawn ( Scheduler* sched, CoroutineFn fn, void* arg );
+
+/**
+ * Resumes the coroutine that owns a completed operation
+ * @param op an operation returned by ioloop_wait()
+ * @return false when the operation is not a coroutine's
+ */
+bool sched_complete ( Scheduler* sched, IoOp* op );
+
+/**
+ * Reads from a descriptor, yielding until the read completes
+ */
+ssize_t co_read ( int fd, void* buf, size_t len );
+
+/**
+ * Writes all of buf to a descriptor, yielding until it is written
+ */
+ssize_t co_write ( int fd, const void* buf, size_t len );
+
+#endif
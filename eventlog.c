@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "eventlog.h"
+
+/*****************************************************
+* Lock-free structured event log
+* The ring is a bounded queue with a sequence number per
+* slot: producers claim a slot with a CAS on the head and
+* publish it by bumping its sequence, so a signal handler
+* interrupting a producer never waits on it. A full ring
+* drops the event and counts it instead of blocking.
+* Author: Gloire Rubambiza
+* Version: 10/22/2017
+******************************************************/
+
+#define FLUSH_BUFFER_SIZE 8192
+#define MAX_LINE_SIZE 256
+
+typedef struct EventSlot {
+  _Atomic uint64_t sequence;
+  Event event;
+} EventSlot;
+
+// Field names of a and b for each event type, NULL when unused
+static const char* event_fields[EV_NUM_TYPES][3] = {
+  [EV_MANAGER_STARTED]      = {"manager_started", "spawner_pid", NULL},
+  [EV_SERVER_CREATED]       = {"server_created", "spawn_id", "min"},
+  [EV_SERVER_ABORTED]       = {"server_aborted", "server_pid", "signal"},
+  [EV_SERVER_RESTARTED]     = {"server_restarted", "server_pid", "old_pid"},
+  [EV_SERVER_STARTED]       = {"server_started", "replicas", "listeners"},
+  [EV_SERVER_SHUTDOWN]      = {"server_shutdown", NULL, NULL},
+  [EV_SERVER_INTERRUPTED]   = {"server_interrupted", NULL, NULL},
+  [EV_REPLICA_SPAWNED]      = {"replica_spawned", "replica_pid", "slot"},
+  [EV_REPLICA_SPAWN_FAILED] = {"replica_spawn_failed", "slot", "errno"},
+  [EV_REPLICA_EXITED]       = {"replica_exited", "replica_pid", "slot"},
+  [EV_REPLICA_SHUTDOWN]     = {"replica_shutdown", NULL, NULL},
+  [EV_SERVER_CRASHED]       = {"server_crashed", "server_pid", "status"},
+  [EV_SERVER_RESPAWNED]     = {"server_respawned", "spawn_id", "crashes"},
+  [EV_SERVER_QUARANTINED]   = {"server_quarantined", "crashes", "window_s"},
+  [EV_SERVER_RESUMED]       = {"server_resumed", "spawn_id", NULL},
+  [EV_SERVER_PRELOADED]     = {"server_preloaded", "config_keys", "code_bytes"},
+  [EV_SERVER_OVERLOADED]    = {"server_overloaded", "replicas", "queued"},
+  [EV_SERVER_RECOVERED]     = {"server_recovered", "rejected", "shed"},
+  [EV_REPLICA_RETIRING]     = {"replica_retiring", "replica_pid", "slot"},
+  [EV_REPLICA_DEFERRED]     = {"replica_deferred", "deferred", "active"},
+  [EV_PRESSURE_RAISED]      = {"pressure_raised", "resources", "threshold"},
+  [EV_PRESSURE_CLEARED]     = {"pressure_cleared", "resources", "deferred"},
+  [EV_SCALE_SCHEDULED]      = {"scale_scheduled", "min", "replicas"},
+  [EV_ACCEPT_FAILED]        = {"accept_failed", "listener", "errno"}
+};
+
+static const char* level_names[] = {"debug", "info", "warn", "error"};
+
+static EventSlot ring[EVENTLOG_CAPACITY];
+static _Atomic uint64_t head;                // Next slot producers claim
+static uint64_t tail;                        // Next slot the flush reads
+static _Atomic uint64_t dropped;             // Events lost to a full ring
+static _Atomic uint64_t sampled[EV_NUM_TYPES];
+
+static const char* log_component = "manager";
+static int log_fd = STDERR_FILENO;
+static EventLevel log_level = LOG_INFO;
+static unsigned long log_sample = 1;
+
+/**
+ * Empties the ring, every slot expecting its first lap
+ */
+static void reset_ring (){
+  uint64_t i;
+  for ( i = 0; i < EVENTLOG_CAPACITY; ++i){
+    atomic_store_explicit(&ring[i].sequence, i, memory_order_relaxed);
+  }
+  atomic_store(&head, 0);
+  tail = 0;
+  atomic_store(&dropped, 0);
+}
+
+/**
+ * Configures the log of this process from the environment
+ * @param component the kind of process, "manager", "server" or "replica"
+ */
+void eventlog_init ( const char* component ){
+  log_component = component;
+  reset_ring();
+
+  char* path = getenv(EVENT_LOG_ENV);
+  if ( path != NULL){
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if ( fd >= 0){
+      log_fd = fd;
+    }
+  }
+  char* level = getenv(EVENT_LEVEL_ENV);
+  int i;
+  for ( i = 0; level != NULL && i <= LOG_ERROR; ++i){
+    if ( strcasecmp(level, level_names[i]) == 0){
+      log_level = i;
+    }
+  }
+  char* sample = getenv(EVENT_SAMPLE_ENV);
+  if ( sample != NULL && atol(sample) > 1){
+    log_sample = atol(sample);
+  }
+}
+
+/**
+ * Drops events inherited from the parent, to be called right after fork
+ * The parent flushes them itself, the child would only duplicate them.
+ * @param component the kind of process the child becomes
+ */
+void eventlog_after_fork ( const char* component ){
+  log_component = component;
+  reset_ring();
+}
+
+/**
+ * Records an event, async-signal-safe and lock-free
+ * Warnings and errors are always kept, debug and info events are
+ * sampled per type when SCS_LOG_SAMPLE is set.
+ * @param level the severity of the event
+ * @param type what happened
+ * @param name the server concerned, NULL if none
+ * @param a the first value of the event
+ * @param b the second value of the event
+ */
+void eventlog_emit ( EventLevel level, EventType type, const char* name,
+                     int64_t a, int64_t b ){
+  if ( level < log_level){
+    return;
+  }
+  if ( level <= LOG_INFO && log_sample > 1 &&
+       atomic_fetch_add_explicit(&sampled[type], 1, memory_order_relaxed)
+         % log_sample != 0){
+    return;
+  }
+
+  uint64_t pos = atomic_load_explicit(&head, memory_order_relaxed);
+  EventSlot* slot;
+  while (1) {
+    slot = &ring[pos & (EVENTLOG_CAPACITY - 1)];
+    uint64_t sequence = atomic_load_explicit(&slot->sequence,
+                                             memory_order_acquire);
+    int64_t diff = (int64_t) (sequence - pos);
+    if ( diff == 0){
+      if ( atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1,
+                                                 memory_order_relaxed,
+                                                 memory_order_relaxed)){
+        break;
+      }
+    } else if ( diff < 0){ // Full, the flush has not caught up
+      atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+      return;
+    } else {
+      pos = atomic_load_explicit(&head, memory_order_relaxed);
+    }
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  Event* event = &slot->event;
+  event->timestamp = now.tv_sec * 1000000000ULL + now.tv_nsec;
+  event->level = level;
+  event->type = type;
+  event->pid = getpid();
+  event->name[0] = '\0';
+  if ( name != NULL){
+    strncpy(event->name, name, EVENT_NAME_SIZE - 1);
+    event->name[EVENT_NAME_SIZE - 1] = '\0';
+  }
+  event->a = a;
+  event->b = b;
+  atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+}
+
+/**
+ * Formats one event as a JSON line
+ * @return the length of the line
+ */
+static int format_event ( const Event* event, char* line, size_t size ){
+  const char** fields = event_fields[event->type];
+  int len = snprintf(line, size,
+                     "{\"ts\":%llu.%09llu,\"level\":\"%s\",\"component\":\"%s\","
+                     "\"pid\":%d,\"event\":\"%s\"",
+                     (unsigned long long) (event->timestamp / 1000000000ULL),
+                     (unsigned long long) (event->timestamp % 1000000000ULL),
+                     level_names[event->level], log_component, (int) event->pid,
+                     fields[0]);
+  if ( event->name[0] != '\0'){ // Server names are single tokens, no escaping
+    len += snprintf(line + len, size - len, ",\"server\":\"%s\"", event->name);
+  }
+  if ( fields[1] != NULL){
+    len += snprintf(line + len, size - len, ",\"%s\":%lld", fields[1],
+                    (long long) event->a);
+  }
+  if ( fields[2] != NULL){
+    len += snprintf(line + len, size - len, ",\"%s\":%lld", fields[2],
+                    (long long) event->b);
+  }
+  len += snprintf(line + len, size - len, "}\n");
+  return len < (int) size ? len : (int) size - 1;
+}
+
+/**
+ * Writes out every recorded event, from the process' loop only
+ * Lines are batched so each flush costs a single write().
+ */
+void eventlog_flush (){
+  char buffer[FLUSH_BUFFER_SIZE];
+  size_t len = 0;
+
+  uint64_t lost = atomic_exchange_explicit(&dropped, 0, memory_order_relaxed);
+  if ( lost > 0){
+    len += snprintf(buffer, sizeof(buffer),
+                    "{\"level\":\"warn\",\"component\":\"%s\",\"pid\":%d,"
+                    "\"event\":\"events_dropped\",\"count\":%llu}\n",
+                    log_component, (int) getpid(), (unsigned long long) lost);
+  }
+
+  while (1) {
+    EventSlot* slot = &ring[tail & (EVENTLOG_CAPACITY - 1)];
+    uint64_t sequence = atomic_load_explicit(&slot->sequence,
+                                             memory_order_acquire);
+    if ( sequence != tail + 1){ // Not published yet
+      break;
+    }
+    if ( len + MAX_LINE_SIZE > sizeof(buffer)){
+      write(log_fd, buffer, len);
+      len = 0;
+    }
+    len += format_event(&slot->event, buffer + len, MAX_LINE_SIZE);
+    atomic_store_explicit(&slot->sequence, tail + EVENTLOG_CAPACITY,
+                          memory_order_release);
+    tail++;
+  }
+  if ( len > 0){
+    write(log_fd, buffer, len);
+  }
+}
@@ -0,0 +1,97 @@
+#ifndef H_EVENTLOG
+#define H_EVENTLOG
+#include <stdint.h>
+#include <sys/types.h>
+
+/***********************************************
+* Structured lifecycle event log
+* Events are recorded into a lock-free ring buffer, which is
+* safe from signal handlers, and written out as JSON lines by
+* the owning process' loop, one write() per flush.
+* Author: Gloire Rubambiza
+* Version: 10/22/2017
+***********************************************/
+
+// Environment variables configuring the log, inherited by every server
+#define EVENT_LOG_ENV "SCS_EVENT_LOG"        // File to append to, stderr if unset
+#define EVENT_LEVEL_ENV "SCS_LOG_LEVEL"      // debug, info, warn or error
+#define EVENT_SAMPLE_ENV "SCS_LOG_SAMPLE"    // Keep 1 in N debug and info events
+
+#define EVENTLOG_CAPACITY 1024               // Must be a power of two
+#define EVENT_NAME_SIZE 32
+
+typedef enum EventLevel {
+  LOG_DEBUG,
+  LOG_INFO,
+  LOG_WARN,
+  LOG_ERROR
+} EventLevel;
+
+typedef enum EventType {
+  EV_MANAGER_STARTED,
+  EV_SERVER_CREATED,
+  EV_SERVER_ABORTED,
+  EV_SERVER_RESTARTED,
+  EV_SERVER_STARTED,
+  EV_SERVER_SHUTDOWN,
+  EV_SERVER_INTERRUPTED,
+  EV_REPLICA_SPAWNED,
+  EV_REPLICA_SPAWN_FAILED,
+  EV_REPLICA_EXITED,
+  EV_REPLICA_SHUTDOWN,
+  EV_SERVER_CRASHED,
+  EV_SERVER_RESPAWNED,
+  EV_SERVER_QUARANTINED,
+  EV_SERVER_RESUMED,
+  EV_SERVER_PRELOADED,
+  EV_SERVER_OVERLOADED,
+  EV_SERVER_RECOVERED,
+  EV_REPLICA_RETIRING,
+  EV_REPLICA_DEFERRED,
+  EV_PRESSURE_RAISED,
+  EV_PRESSURE_CLEARED,
+  EV_SCALE_SCHEDULED,
+  EV_ACCEPT_FAILED,
+  EV_NUM_TYPES
+} EventType;
+
+// One recorded event, its meaning of a and b depends on the type
+typedef struct Event {
+  uint64_t timestamp;                        // Nanoseconds since the epoch
+  EventLevel level;
+  EventType type;
+  pid_t pid;                                 // Process that recorded it
+  char name[EVENT_NAME_SIZE];                // Server concerned, may be empty
+  int64_t a;
+  int64_t b;
+} Event;
+
+/**
+ * Configures the log of this process from the environment
+ * @param component the kind of process, "manager", "server" or "replica"
+ */
+void eventlog_init ( const char* component );
+
+/**
+ * Drops events inherited from the parent, to be called right after fork
+ * @param component the kind of process the child becomes
+ */
+void eventlog_after_fork ( const char* component );
+
+/**
+ * Records an event, async-signal-safe and lock-free
+ * @param level the severity of the event
+ * @param type what happened
+ * @param name the server concerned, NULL if none
+ * @param a the first value of the event
+ * @param b the second value of the event
+ */
+void eventlog_emit ( EventLevel level, EventType type, const char* name,
+                     int64_t a, int64_t b );
+
+/**
+ * Writes out every recorded event, from the process' loop only
+ */
+void eventlog_flush ();
+
+#endif
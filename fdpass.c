@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "fdpass.h"
+
+/*****************************************************
+* SCM_RIGHTS helpers shared by the manager and servers
+* A message is a one byte count followed by the fds in
+* a single control message, so 0 fds is a valid batch
+* Author: Gloire Rubambiza
+* Version: 10/19/2017
+******************************************************/
+
+/**
+ * Sends a message together with a batch of file descriptors
+ * @param sock the connected Unix domain socket
+ * @param data the payload, at least one byte
+ * @param len the size of the payload
+ * @param fds the descriptors to send
+ * @param num_fds how many descriptors to send, may be 0
+ * @return 0 on success, -1 on error
+ */
+int send_msg_fds ( int sock, const void* data, size_t len, const int fds[],
+                   int num_fds ){
+  if ( num_fds < 0 || num_fds > MAX_PASSED_FDS){
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct iovec iov = { .iov_base = (void*) data, .iov_len = len };
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if ( num_fds > 0){
+    memset(&control, 0, sizeof(control));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+  }
+
+  ssize_t sent;
+  do {
+    sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while ( sent < 0 && errno == EINTR);
+  return sent == (ssize_t) len ? 0 : -1;
+}
+
+/**
+ * Receives a message and the descriptors sent with it
+ * Descriptors beyond max_fds are closed rather than leaked
+ * @param sock the connected Unix domain socket
+ * @param data the buffer for the payload
+ * @param len the size of the buffer
+ * @param fds the array that will hold the received descriptors
+ * @param max_fds the capacity of fds
+ * @param num_fds set to the number of descriptors received
+ * @return the size of the payload, 0 at end of file, -1 on error
+ */
+ssize_t recv_msg_fds ( int sock, void* data, size_t len, int fds[],
+                       int max_fds, int* num_fds ){
+  struct iovec iov = { .iov_base = data, .iov_len = len };
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  ssize_t got;
+  do {
+    got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while ( got < 0 && errno == EINTR);
+
+  *num_fds = 0;
+  struct cmsghdr* cmsg;
+  for ( cmsg = got >= 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg != NULL;
+        cmsg = CMSG_NXTHDR(&msg, cmsg)){
+    if ( cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS){
+      continue;
+    }
+    int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int* passed = (int*) CMSG_DATA(cmsg);
+    int i;
+    for ( i = 0; i < n; ++i){
+      if ( *num_fds < max_fds){
+        fds[(*num_fds)++] = passed[i];
+      } else {
+        close(passed[i]);
+      }
+    }
+  }
+  return got;
+}
+
+/**
+ * Sends a batch of file descriptors over a Unix socket with SCM_RIGHTS
+ * @param sock the connected Unix domain socket
+ * @param fds the descriptors to send
+ * @param num_fds how many descriptors to send, may be 0
+ * @return 0 on success, -1 on error
+ */
+int send_fds ( int sock, const int fds[], int num_fds ){
+  unsigned char count = (unsigned char) num_fds;
+  return send_msg_fds(sock, &count, sizeof(count), fds, num_fds);
+}
+
+/**
+ * Receives a batch of file descriptors sent by send_fds()
+ * @param sock the connected Unix domain socket
+ * @param fds the array that will hold the received descriptors
+ * @param max_fds the capacity of fds
+ * @return the number of descriptors received, -1 on error
+ */
+int recv_fds ( int sock, int fds[], int max_fds ){
+  unsigned char count;
+  int received;
+  if ( recv_msg_fds(sock, &count, sizeof(count), fds, max_fds,
+                    &received) != sizeof(count)){
+    close_fds(fds, &received);
+    return -1;
+  }
+  return received;
+}
+
+/**
+ * Closes every descriptor in the given array and resets its count
+ */
+void close_fds ( int fds[], int* num_fds ){
+  int i;
+  for ( i = 0; i < *num_fds; ++i){
+    close(fds[i]);
+    fds[i] = -1;
+  }
+  *num_fds = 0;
+}
@@ -0,0 +1,72 @@
+#ifndef H_FDPASS
+#define H_FDPASS
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <signal.h>
+
+/***********************************************
+* Passes open file descriptors between the manager
+* and its servers over Unix domain sockets
+* Author: Gloire Rubambiza
+* Version: 10/19/2017
+***********************************************/
+
+#define MAX_PASSED_FDS 16
+
+// Environment variable naming the server's end of its control socket
+#define CONTROL_FD_ENV "SCS_CONTROL_FD"
+
+// Signal asking a server to retire its newest replica, after SIGUSR2
+// asked it for one more
+#define RETIRE_SIGNAL SIGRTMIN
+
+/**
+ * Sends a batch of file descriptors over a Unix socket with SCM_RIGHTS
+ * @param sock the connected Unix domain socket
+ * @param fds the descriptors to send
+ * @param num_fds how many descriptors to send, may be 0
+ * @return 0 on success, -1 on error
+ */
+int send_fds ( int sock, const int fds[], int num_fds );
+
+/**
+ * Receives a batch of file descriptors sent by send_fds()
+ * @param sock the connected Unix domain socket
+ * @param fds the array that will hold the received descriptors
+ * @param max_fds the capacity of fds
+ * @return the number of descriptors received, -1 on error
+ */
+int recv_fds ( int sock, int fds[], int max_fds );
+
+/**
+ * Sends a message together with a batch of file descriptors
+ * @param sock the connected Unix domain socket
+ * @param data the payload, at least one byte
+ * @param len the size of the payload
+ * @param fds the descriptors to send
+ * @param num_fds how many descriptors to send, may be 0
+ * @return 0 on success, -1 on error
+ */
+int send_msg_fds ( int sock, const void* data, size_t len, const int fds[],
+                   int num_fds );
+
+/**
+ * Receives a message and the descriptors sent with it
+ * @param sock the connected Unix domain socket
+ * @param data the buffer for the payload
+ * @param len the size of the buffer
+ * @param fds the array that will hold the received descriptors
+ * @param max_fds the capacity of fds
+ * @param num_fds set to the number of descriptors received
+ * @return the size of the payload, 0 at end of file, -1 on error
+ */
+ssize_t recv_msg_fds ( int sock, void* data, size_t len, int fds[],
+                       int max_fds, int* num_fds );
+
+/**
+ * Closes every descriptor in the given array and resets its count
+ */
+void close_fds ( int fds[], int* num_fds );
+
+#endif
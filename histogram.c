@@ -0,0 +1,110 @@
+#include <stdint.h>
+#include <stdatomic.h>
+#include "histogram.h"
+
+/*****************************************************
+* Log-linear histogram used for per-replica latencies
+* Author: Gloire Rubambiza
+* Version: 10/20/2017
+******************************************************/
+
+/**
+ * Maps a value to its bucket
+ * Values below HIST_SUB_BUCKETS get a bucket each, larger ones share
+ * HIST_SUB_BUCKETS buckets per power of two.
+ */
+static int bucket_index ( uint64_t value ){
+  if ( value < HIST_SUB_BUCKETS){
+    return (int) value;
+  }
+  int exponent = 63 - __builtin_clzll(value);
+  int shift = exponent - HIST_SUB_BUCKET_BITS;
+  int sub = (int) (value >> shift) - HIST_SUB_BUCKETS;
+  return HIST_SUB_BUCKETS * (shift + 1) + sub;
+}
+
+/**
+ * Maps a bucket back to the middle of the values it covers
+ */
+static uint64_t bucket_value ( int index ){
+  if ( index < HIST_SUB_BUCKETS){
+    return (uint64_t) index;
+  }
+  int shift = index / HIST_SUB_BUCKETS - 1;
+  uint64_t sub = (uint64_t) (index % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS);
+  uint64_t lowest = sub << shift;
+  return lowest + (((uint64_t) 1 << shift) >> 1);
+}
+
+/**
+ * Records one value, safe to call concurrently from any process
+ * @param hist the histogram to record into
+ * @param value the value to record, in nanoseconds for latencies
+ */
+void hist_record ( Histogram* hist, uint64_t value ){
+  atomic_fetch_add_explicit(&hist->counts[bucket_index(value)], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&hist->total, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&hist->sum, value, memory_order_relaxed);
+
+  uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+  while ( value > max &&
+          !atomic_compare_exchange_weak_explicit(&hist->max, &max, value,
+                                                 memory_order_relaxed,
+                                                 memory_order_relaxed));
+}
+
+/**
+ * Adds all the counts of src into dst
+ * src may be recording concurrently, the result is then a close snapshot
+ */
+void hist_merge ( Histogram* dst, const Histogram* src ){
+  int i;
+  uint64_t total = 0;
+  for ( i = 0; i < HIST_NUM_BUCKETS; ++i){
+    uint64_t count = atomic_load_explicit(&src->counts[i], memory_order_relaxed);
+    if ( count > 0){
+      atomic_fetch_add_explicit(&dst->counts[i], count, memory_order_relaxed);
+      total += count;
+    }
+  }
+  // Derive the total from the buckets so percentiles stay consistent
+  atomic_fetch_add_explicit(&dst->total, total, memory_order_relaxed);
+  atomic_fetch_add_explicit(&dst->sum,
+                            atomic_load_explicit(&src->sum, memory_order_relaxed),
+                            memory_order_relaxed);
+
+  uint64_t max = atomic_load_explicit(&src->max, memory_order_relaxed);
+  if ( max > atomic_load_explicit(&dst->max, memory_order_relaxed)){
+    atomic_store_explicit(&dst->max, max, memory_order_relaxed);
+  }
+}
+
+/**
+ * Returns the value at the given percentile
+ * @param hist the histogram to query
+ * @param percentile between 0 and 100
+ * @return the representative value of the matching bucket, 0 if empty
+ */
+uint64_t hist_percentile ( const Histogram* hist, double percentile ){
+  uint64_t total = atomic_load_explicit(&hist->total, memory_order_relaxed);
+  if ( total == 0){
+    return 0;
+  }
+  uint64_t target = (uint64_t) (percentile / 100.0 * total + 0.5);
+  if ( target < 1){
+    target = 1;
+  }
+
+  uint64_t seen = 0;
+  int i;
+  for ( i = 0; i < HIST_NUM_BUCKETS; ++i){
+    seen += atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+    if ( seen >= target){
+      uint64_t value = bucket_value(i);
+      uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+      return value < max ? value : max;
+    }
+  }
+  return atomic_load_explicit(&hist->max, memory_order_relaxed);
+}
@@ -0,0 +1,47 @@
+#ifndef H_HISTOGRAM
+#define H_HISTOGRAM
+#include <stdint.h>
+#include <stdatomic.h>
+
+/***********************************************
+* Log-linear latency histogram in the style of HDR
+* Each power of two is split in HIST_SUB_BUCKETS linear
+* buckets, keeping the relative error under 1/32.
+* Recording is a single relaxed atomic add, so the
+* histogram can live in memory shared between processes.
+* Author: Gloire Rubambiza
+* Version: 10/20/2017
+***********************************************/
+
+#define HIST_SUB_BUCKET_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BUCKET_BITS)
+#define HIST_NUM_BUCKETS (HIST_SUB_BUCKETS * (64 - HIST_SUB_BUCKET_BITS + 1))
+
+typedef struct Histogram {
+  _Atomic uint64_t counts[HIST_NUM_BUCKETS];
+  _Atomic uint64_t total;
+  _Atomic uint64_t sum;
+  _Atomic uint64_t max;
+} Histogram;
+
+/**
+ * Records one value, safe to call concurrently from any process
+ * @param hist the histogram to record into
+ * @param value the value to record, in nanoseconds for latencies
+ */
+void hist_record ( Histogram* hist, uint64_t value );
+
+/**
+ * Adds all the counts of src into dst
+ */
+void hist_merge ( Histogram* dst, const Histogram* src );
+
+/**
+ * Returns the value at the given percentile
+ * @param hist the histogram to query
+ * @param percentile between 0 and 100
+ * @return the representative value of the matching bucket, 0 if empty
+ */
+uint64_t hist_percentile ( const Histogram* hist, double percentile );
+
+#endif
@@ -0,0 +1,456 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/io_uring.h>
+#include "ioloop.h"
+
+/*****************************************************
+* io_uring through its raw system calls, with an epoll fallback
+* Author: Gloire Rubambiza
+* Version: 10/27/2017
+******************************************************/
+
+// Older headers stop before it, the probe tells whether the kernel has it
+#define SCS_IORING_OP_WAITID 50
+
+// Waiting with operations in flight counts as I/O wait, and so as I/O
+// pressure, unless the kernel lets us say otherwise. Accepts that idle
+// for a client are no stall, and would set off the manager's PSI triggers.
+#define SCS_IORING_ENTER_NO_IOWAIT (1U << 7)
+#define SCS_IORING_FEAT_NO_IOWAIT (1U << 17)
+
+#define EPOLL_BATCH 64
+
+/**
+ * Tells whether the kernel supports an io_uring operation
+ */
+static bool op_supported ( const struct io_uring_probe* probe, int opcode ){
+  return probe->last_op >= opcode &&
+         (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+}
+
+/**
+ * Probes a fresh io_uring for every operation the loop submits
+ * Accepts, reads, writes and polls must all be there, or each would
+ * complete with -EINVAL; IORING_OP_WAITID is only used when present.
+ * @param loop the loop being set up
+ * @return 0 if io_uring can carry the loop, -1 otherwise
+ */
+static int uring_probe ( IoLoop* loop ){
+  const int required[] = { IORING_OP_ACCEPT, IORING_OP_READ, IORING_OP_WRITE,
+                           IORING_OP_POLL_ADD };
+  size_t probe_size = sizeof(struct io_uring_probe)
+                      + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* probe = calloc(1, probe_size);
+  if ( probe == NULL ||
+       syscall(__NR_io_uring_register, loop->fd, IORING_REGISTER_PROBE,
+               probe, 256) < 0){
+    free(probe);
+    return -1;
+  }
+  int i, result = 0;
+  for ( i = 0; i < (int) (sizeof(required) / sizeof(required[0])); ++i){
+    if ( !op_supported(probe, required[i])){
+      result = -1;
+    }
+  }
+  loop->waitid = op_supported(probe, SCS_IORING_OP_WAITID);
+  free(probe);
+  return result;
+}
+
+/**
+ * Maps the rings of a fresh io_uring, once it has every operation needed
+ * @param loop the loop to set up
+ * @param entries the most operations expected in flight
+ * @return 0 on success, -1 when io_uring is unusable here
+ */
+static int uring_setup ( IoLoop* loop, unsigned entries ){
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  loop->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if ( loop->fd < 0){
+    return -1;
+  }
+  // Kernels before 5.4, or missing an operation the loop submits
+  if ( !(params.features & IORING_FEAT_SINGLE_MMAP) || uring_probe(loop) < 0){
+    close(loop->fd);
+    return -1;
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes
+                   + params.cq_entries * sizeof(struct io_uring_cqe);
+  loop->rings_size = sq_size > cq_size ? sq_size : cq_size;
+  loop->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  loop->rings = mmap(NULL, loop->rings_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, loop->fd, IORING_OFF_SQ_RING);
+  loop->sqes = mmap(NULL, loop->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, loop->fd, IORING_OFF_SQES);
+  if ( loop->rings == MAP_FAILED || loop->sqes == MAP_FAILED){
+    if ( loop->rings != MAP_FAILED){
+      munmap(loop->rings, loop->rings_size);
+    }
+    if ( loop->sqes != MAP_FAILED){
+      munmap(loop->sqes, loop->sqes_size);
+    }
+    close(loop->fd);
+    return -1;
+  }
+
+  char* rings = loop->rings;
+  loop->sq_head = (unsigned*) (rings + params.sq_off.head);
+  loop->sq_tail = (unsigned*) (rings + params.sq_off.tail);
+  loop->sq_mask = (unsigned*) (rings + params.sq_off.ring_mask);
+  loop->sq_array = (unsigned*) (rings + params.sq_off.array);
+  loop->cq_head = (unsigned*) (rings + params.cq_off.head);
+  loop->cq_tail = (unsigned*) (rings + params.cq_off.tail);
+  loop->cq_mask = (unsigned*) (rings + params.cq_off.ring_mask);
+  loop->cqes = (struct io_uring_cqe*) (rings + params.cq_off.cqes);
+  loop->uring = true;
+  if ( params.features & SCS_IORING_FEAT_NO_IOWAIT){
+    loop->enter_flags = SCS_IORING_ENTER_NO_IOWAIT;
+  }
+  return 0;
+}
+
+/**
+ * Sets up io_uring, or epoll when it is unavailable or not wanted
+ * @param loop the loop to set up
+ * @param entries the most operations expected in flight
+ * @return 0 on success, -1 on error
+ */
+int ioloop_init ( IoLoop* loop, unsigned entries ){
+  memset(loop, 0, sizeof(IoLoop));
+  loop->ready_tail = &loop->ready;
+  const char* backend = getenv(IO_BACKEND_ENV);
+  if ( (backend == NULL || strcmp(backend, "epoll") != 0) &&
+       uring_setup(loop, entries) == 0){
+    return 0;
+  }
+  loop->waitid = false; // Whatever the probe found, epoll cannot use it
+  loop->fd = epoll_create1(EPOLL_CLOEXEC);
+  return loop->fd < 0 ? -1 : 0;
+}
+
+/**
+ * Releases the loop, operations still in flight are cancelled
+ * @param loop the loop to release
+ */
+void ioloop_close ( IoLoop* loop ){
+  if ( loop->uring){
+    munmap(loop->sqes, loop->sqes_size);
+    munmap(loop->rings, loop->rings_size);
+  }
+  if ( loop->fd >= 0){
+    close(loop->fd);
+  }
+  memset(loop, 0, sizeof(IoLoop));
+  loop->fd = -1;
+  loop->ready_tail = &loop->ready;
+}
+
+/**
+ * Hands the queued entries to the kernel, optionally waiting
+ * @param loop an io_uring loop
+ * @param wait_for the completions to wait for, 0 to only submit
+ * @return 0 on success, -errno on error
+ */
+static int uring_enter ( IoLoop* loop, unsigned wait_for ){
+  int submitted = syscall(__NR_io_uring_enter, loop->fd, loop->queued,
+                          wait_for, wait_for ? IORING_ENTER_GETEVENTS
+                                                 | loop->enter_flags : 0,
+                          NULL, 0);
+  if ( submitted < 0){
+    return errno == EINTR ? 0 : -errno;
+  }
+  loop->queued -= submitted;
+  return 0;
+}
+
+/**
+ * Queues an operation as a submission queue entry
+ * @return 0 on success, -errno on error
+ */
+static int uring_submit ( IoLoop* loop, IoOp* op ){
+  unsigned tail = *loop->sq_tail;
+  if ( tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE)
+       > *loop->sq_mask){ // Full, hand the queued entries over first
+    int error = uring_enter(loop, 0);
+    if ( error < 0){
+      return error;
+    }
+    if ( tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE)
+         > *loop->sq_mask){
+      return -EBUSY;
+    }
+  }
+
+  unsigned index = tail & *loop->sq_mask;
+  struct io_uring_sqe* sqe = &loop->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->fd = op->fd;
+  sqe->user_data = (unsigned long) op;
+  switch ( op->kind){
+    case IO_ACCEPT:
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->accept_flags = op->flags;
+      break;
+    case IO_READ:
+    case IO_WRITE:
+      sqe->opcode = op->kind == IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+      sqe->addr = (unsigned long) op->buf;
+      sqe->len = op->len;
+      sqe->off = (__u64) -1; // Sockets and pipes have no file position
+      break;
+    case IO_POLL:
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->poll32_events = op->flags;
+      break;
+    case IO_WAITID:
+      if ( !loop->waitid){
+        return -ENOSYS;
+      }
+      sqe->opcode = SCS_IORING_OP_WAITID;
+      sqe->len = op->len;
+      sqe->file_index = op->flags;
+      sqe->addr2 = (unsigned long) op->buf;
+      break;
+  }
+  loop->sq_array[index] = index;
+  __atomic_store_n(loop->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  loop->queued++;
+  return 0;
+}
+
+/**
+ * Moves completion queue entries to the caller
+ * @return the number of operations moved
+ */
+static int uring_collect ( IoLoop* loop, IoOp** done, int max ){
+  unsigned head = *loop->cq_head;
+  unsigned tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+  int n = 0;
+  while ( head != tail && n < max){
+    struct io_uring_cqe* cqe = &loop->cqes[head & *loop->cq_mask];
+    IoOp* op = (IoOp*) (unsigned long) cqe->user_data;
+    op->result = cqe->res;
+    done[n++] = op;
+    head++;
+  }
+  __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+/**
+ * Attempts an operation without blocking, as the epoll fallback does
+ * @return what the call returned, -errno on error, -EAGAIN to wait
+ */
+static int try_op ( IoOp* op ){
+  int result = -1;
+  switch ( op->kind){
+    case IO_ACCEPT:
+      result = accept4(op->fd, NULL, NULL, op->flags);
+      break;
+    case IO_READ:
+      result = read(op->fd, op->buf, op->len);
+      break;
+    case IO_WRITE:
+      result = write(op->fd, op->buf, op->len);
+      break;
+    case IO_POLL: {
+      struct pollfd pfd = { .fd = op->fd, .events = op->flags };
+      result = poll(&pfd, 1, 0);
+      return result > 0 ? pfd.revents : result == 0 ? -EAGAIN : -errno;
+    }
+    case IO_WAITID:
+      return -ENOSYS;
+  }
+  return result < 0 ? -errno : result;
+}
+
+/**
+ * Waits for the descriptor of an operation to become ready, once
+ * @return 0 on success, -errno on error
+ */
+static int epoll_arm ( IoLoop* loop, IoOp* op ){
+  struct epoll_event ev = { .data.ptr = op };
+  if ( op->kind == IO_POLL){
+    ev.events = op->flags;
+  } else {
+    ev.events = op->kind == IO_WRITE ? EPOLLOUT : EPOLLIN;
+  }
+  ev.events |= EPOLLONESHOT;
+  if ( epoll_ctl(loop->fd, EPOLL_CTL_MOD, op->fd, &ev) < 0 &&
+       (errno != ENOENT || epoll_ctl(loop->fd, EPOLL_CTL_ADD, op->fd, &ev) < 0)){
+    return -errno;
+  }
+  return 0;
+}
+
+/**
+ * Queues an operation completed without waiting
+ */
+static void epoll_ready ( IoLoop* loop, IoOp* op, int result ){
+  op->result = result;
+  op->next = NULL;
+  *loop->ready_tail = op;
+  loop->ready_tail = &op->next;
+}
+
+/**
+ * Queues an operation, it completes through ioloop_wait()
+ * Without io_uring it is attempted right away and only waits in the
+ * epoll set when it would block.
+ * @param loop the loop
+ * @param op the operation, left untouched by the caller until it completes
+ * @return 0 on success, -errno on error
+ */
+int ioloop_submit ( IoLoop* loop, IoOp* op ){
+  if ( loop->uring){
+    return uring_submit(loop, op);
+  }
+  int result = try_op(op);
+  if ( result == -ENOSYS){
+    return result;
+  }
+  if ( result != -EAGAIN){
+    epoll_ready(loop, op, result);
+    return 0;
+  }
+  return epoll_arm(loop, op);
+}
+
+/**
+ * Submits what was queued and collects completed operations
+ * With io_uring both happen in the same system call.
+ * @param loop the loop
+ * @param done receives up to max completed operations
+ * @param max the room in done
+ * @param block whether to wait until at least one completes
+ * @return the number of completed operations, -errno on error
+ */
+int ioloop_wait ( IoLoop* loop, IoOp** done, int max, bool block ){
+  int n;
+  if ( loop->uring){
+    n = uring_collect(loop, done, max);
+    if ( loop->queued > 0 || (n == 0 && block)){
+      int error = uring_enter(loop, n == 0 && block ? 1 : 0);
+      if ( error < 0){
+        return error;
+      }
+      n += uring_collect(loop, done + n, max - n);
+    }
+    return n;
+  }
+
+  struct epoll_event events[EPOLL_BATCH];
+  int i, ready = epoll_wait(loop->fd, events, EPOLL_BATCH,
+                            loop->ready != NULL || !block ? 0 : -1);
+  for ( i = 0; i < ready; ++i){
+    IoOp* op = events[i].data.ptr;
+    int result = try_op(op);
+    if ( result == -EAGAIN){ // Another replica won it, wait for the next
+      result = epoll_arm(loop, op);
+      if ( result < 0){
+        epoll_ready(loop, op, result);
+      }
+    } else {
+      epoll_ready(loop, op, result);
+    }
+  }
+  for ( n = 0; n < max && loop->ready != NULL; ++n){
+    done[n] = loop->ready;
+    loop->ready = loop->ready->next;
+  }
+  if ( loop->ready == NULL){
+    loop->ready_tail = &loop->ready;
+  }
+  return ready < 0 && errno != EINTR ? -errno : n;
+}
+
+/**
+ * Starts watching for exited children, SIGCHLD must be blocked
+ * @param watch the watch to start
+ * @return the descriptor to poll for POLLIN, -1 on error
+ */
+int child_watch_init ( ChildWatch* watch ){
+  memset(watch, 0, sizeof(ChildWatch));
+  watch->signal_fd = -1;
+  if ( ioloop_init(&watch->loop, 4) == 0 && watch->loop.waitid){
+    child_watch_rearm(watch);
+    return watch->loop.fd;
+  }
+  ioloop_close(&watch->loop);
+
+  sigset_t sigchld;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  watch->signal_fd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC);
+  return watch->signal_fd;
+}
+
+/**
+ * Rearms the watch after a child was started, in case it had none left
+ * A waitid with no children fails right away and is not retried until then.
+ * @param watch the watch
+ */
+void child_watch_rearm ( ChildWatch* watch ){
+  if ( watch->signal_fd >= 0 || watch->armed){
+    return;
+  }
+  memset(&watch->info, 0, sizeof(watch->info));
+  watch->op = (IoOp) { .kind = IO_WAITID, .fd = 0, .buf = &watch->info,
+                       .len = P_ALL, .flags = WEXITED };
+  if ( ioloop_submit(&watch->loop, &watch->op) == 0){
+    watch->armed = true;
+    ioloop_wait(&watch->loop, NULL, 0, false);
+  }
+}
+
+/**
+ * Rebuilds a waitpid() status from what waitid() reported
+ */
+static int wait_status ( const siginfo_t* info ){
+  if ( info->si_code == CLD_EXITED){
+    return (info->si_status & 0xff) << 8;
+  }
+  return (info->si_status & 0x7f) | (info->si_code == CLD_DUMPED ? 0x80 : 0);
+}
+
+/**
+ * Reaps the next exited child without blocking
+ * @param watch the watch
+ * @param status set to the wait status of the child
+ * @return its pid, 0 when none is left to reap
+ */
+pid_t child_watch_reap ( ChildWatch* watch, int* status ){
+  if ( watch->signal_fd >= 0){
+    struct signalfd_siginfo info;
+    while ( read(watch->signal_fd, &info, sizeof(info)) == sizeof(info));
+    pid_t pid = waitpid(-1, status, WNOHANG);
+    return pid > 0 ? pid : 0;
+  }
+
+  IoOp* done;
+  if ( ioloop_wait(&watch->loop, &done, 1, false) <= 0){
+    return 0;
+  }
+  watch->armed = false;
+  if ( watch->op.result < 0){ // No children left
+    return 0;
+  }
+  pid_t pid = watch->info.si_pid;
+  *status = wait_status(&watch->info);
+  child_watch_rearm(watch);
+  return pid;
+}
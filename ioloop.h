@@ -0,0 +1,121 @@
+#ifndef H_IOLOOP
+#define H_IOLOOP
+#include <stdbool.h>
+#include <stddef.h>
+#include <signal.h>
+#include <sys/types.h>
+
+/***********************************************
+* Completion-based I/O for the replica and manager loops
+* Operations are queued and handed to the kernel in one
+* io_uring_enter() per loop iteration, together with the wait
+* for their completions. Where io_uring is missing or
+* SCS_IO_BACKEND=epoll, the same calls are carried out with
+* non-blocking system calls and an epoll set instead.
+* Author: Gloire Rubambiza
+* Version: 10/27/2017
+***********************************************/
+
+#define IO_BACKEND_ENV "SCS_IO_BACKEND"
+
+typedef enum IoKind {
+  IO_ACCEPT,                           // accept4(fd, flags)
+  IO_READ,                             // read(fd, buf, len)
+  IO_WRITE,                            // write(fd, buf, len)
+  IO_POLL,                             // poll(fd, flags), result is revents
+  IO_WAITID                            // waitid(len, fd, buf, flags)
+} IoKind;
+
+// An operation in flight, owned by the caller until it completes
+typedef struct IoOp {
+  IoKind kind;
+  int fd;                              // The pid or 0 for IO_WAITID
+  void* buf;                           // The siginfo_t for IO_WAITID
+  size_t len;                          // The idtype for IO_WAITID
+  int flags;                           // accept4 flags, events or options
+  int result;                          // What the call returned, or -errno
+  void* owner;                         // Whoever waits on the operation
+  struct IoOp* next;                   // Completed and not yet returned
+} IoOp;
+
+typedef struct IoLoop {
+  bool uring;                          // Otherwise the epoll fallback
+  bool waitid;                         // IORING_OP_WAITID is supported
+  unsigned enter_flags;                // Added to every waiting enter
+  int fd;                              // The io_uring or epoll descriptor
+
+  // io_uring submission and completion rings
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+  void* rings;
+  size_t rings_size;
+  size_t sqes_size;
+  unsigned queued;                     // Prepared but not yet submitted
+
+  // Operations the epoll fallback completed without waiting
+  IoOp* ready;
+  IoOp** ready_tail;
+} IoLoop;
+
+/**
+ * Sets up io_uring, or epoll when it is unavailable or not wanted
+ * @param entries the most operations expected in flight
+ * @return 0 on success, -1 on error
+ */
+int ioloop_init ( IoLoop* loop, unsigned entries );
+
+/**
+ * Releases the loop, operations still in flight are cancelled
+ */
+void ioloop_close ( IoLoop* loop );
+
+/**
+ * Queues an operation, it completes through ioloop_wait()
+ * @return 0 on success, -errno on error
+ */
+int ioloop_submit ( IoLoop* loop, IoOp* op );
+
+/**
+ * Submits what was queued and collects completed operations
+ * @param done receives up to max completed operations
+ * @param block whether to wait until at least one completes
+ * @return the number of completed operations, -errno on error
+ */
+int ioloop_wait ( IoLoop* loop, IoOp** done, int max, bool block );
+
+// Reaps exited children, through IORING_OP_WAITID where the kernel has
+// it and through a signalfd for SIGCHLD otherwise
+typedef struct ChildWatch {
+  IoLoop loop;
+  IoOp op;
+  siginfo_t info;
+  bool armed;                          // A waitid is in flight
+  int signal_fd;                       // Only used without IORING_OP_WAITID
+} ChildWatch;
+
+/**
+ * Starts watching for exited children, SIGCHLD must be blocked
+ * @return the descriptor to poll for POLLIN, -1 on error
+ */
+int child_watch_init ( ChildWatch* watch );
+
+/**
+ * Rearms the watch after a child was started, in case it had none left
+ */
+void child_watch_rearm ( ChildWatch* watch );
+
+/**
+ * Reaps the next exited child without blocking
+ * @param status set to the wait status of the child
+ * @return its pid, 0 when none is left to reap
+ */
+pid_t child_watch_reap ( ChildWatch* watch, int* status );
+
+#endif
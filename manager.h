@@ -3,6 +3,13 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include "fdpass.h"
+#include "stats.h"
+#include "spawner.h"
+#include "pressure.h"
+#include "qos.h"
+#include "agent.h"
+#include "timerwheel.h"
 /***********************************************
 * Defines the struct and operations of a manager
 * Author: Gloire Rubambiza
@@ -11,11 +18,76 @@
 
 typedef char* ServerName;
 
+// Options following the limits of createServer, passed on to the server
+#define MAX_OPTIONS 10
+
+// Crash-loop protection: a server that exits on its own is respawned after
+// a backoff doubling from RESPAWN_BASE_DELAY seconds, and quarantined once
+// it has exited CRASH_LIMIT times within CRASH_WINDOW seconds
+#define CRASH_LIMIT 5
+#define CRASH_WINDOW 60.0
+#define RESPAWN_BASE_DELAY 0.1
+#define RESPAWN_MAX_DELAY 30.0
+
+// Under host pressure servers lose a replica per PSI window, down to their
+// minimum, and new replicas wait. Once it clears, waiting replicas start
+// one per server every DEFERRED_RELEASE_INTERVAL seconds.
+#define SCALE_DOWN_INTERVAL (PRESSURE_WINDOW_US / 1e6)
+#define DEFERRED_RELEASE_INTERVAL 1.0
+
+// A daily rule setting a server's minimum, as added by scheduleScale.
+// Rules are kept by server name, so they outlive the server they were
+// added for and apply to whichever server carries the name next.
+typedef struct ScaleRule {
+  Timer timer;                         // First, so expired timers cast back
+  char* server;
+  int hour;
+  int minute;
+  int min;
+  int max;                             // 0 keeps the server's maximum
+  struct ScaleRule* next;              // All rules, newest first
+} ScaleRule;
+
+// Steps of the handshake over a new server's control socket
+typedef enum Handshake {
+  HANDSHAKE_DONE,
+  HANDSHAKE_LISTENERS,                 // Waiting for the listeners it uses
+  HANDSHAKE_STATS                      // Waiting for its statistics memfd
+} Handshake;
+
+typedef enum ServerState {
+  SERVER_RUNNING,
+  SERVER_BACKOFF,                      // Exited, waiting to be respawned
+  SERVER_QUARANTINED                   // Crash-looping, left down until resumed
+} ServerState;
+
 typedef struct Servers {
   ServerName name;
   pid_t server_pid;
   int active_processes;
+  int min_process;
   int max_process;
+  int deferred;                        // Replicas waiting to be started
+  double scaled_at;                    // Last replica added or retired
+  char* options[MAX_OPTIONS];          // Port and key=value server options
+  int num_options;
+  QosClass qos;                        // From its qos= option, for display
+  int control_fd;                      // Manager's end of the control socket
+  int listen_fds[MAX_PASSED_FDS];      // Listeners held across restarts
+  int num_listen_fds;
+  const ServerStats* stats;            // Mapped from the server, may be NULL
+  unsigned long restarts;
+  ServerState state;
+  double started_at;                   // Monotonic time of the last spawn
+  double respawn_at;                   // When a server in backoff comes back
+  double crash_times[CRASH_LIMIT];     // Last exits, oldest overwritten first
+  int crash_index;
+  int backoff_level;
+  unsigned long crashes;
+  uint32_t spawn_id;                   // Request the spawner is answering
+  Handshake handshake;
+  pid_t retiring_pid;                  // Old instance stopped once we are up
+  bool overloaded;                     // Some replica reported a full queue
 } Server;
 
 /**
@@ -36,13 +108,168 @@ void update_struct (Server* server, pid_t* pid);
 /**
  * Create a server and fill the pid
 */
-pid_t create_server ( char* tokens[] );
+pid_t create_server ( Server* server, char* tokens[] );
+
+/**
+ * Restarts a server, handing its listeners to the new instance
+ */
+pid_t restart_server ( Server* server );
+
+/**
+ * Starts a new instance of a server from its struct
+ */
+pid_t respawn_server ( Server* server );
+
+/**
+ * Reaps servers orphaned by a spawner that died, and the spawner itself
+ */
+void reap_servers ( Server manager[] );
+
+/**
+ * Handles a spawn result or a server exit reported by the spawner
+ */
+void handle_spawner ( Server manager[] );
+
+/**
+ * Advances the handshake with a new server over its control socket
+ */
+void continue_handshake ( Server* server );
+
+/**
+ * Reads the overload notices a running server's replicas sent
+ */
+void read_load_notices ( Server* server );
+
+/**
+ * Logs a server becoming overloaded or recovering
+ */
+void update_overload ( Server* server );
+
+/**
+ * Records the unexpected exit of a server, backing off or quarantining it
+ */
+void server_exited ( Server* server, int status );
+
+/**
+ * Respawns the servers whose backoff has elapsed
+ */
+void respawn_due ( Server manager[] );
+
+/**
+ * Returns how long the event loop may sleep before the next respawn
+ */
+int next_respawn_timeout ( Server manager[] );
+
+/**
+ * Retires replicas while the host is under pressure, and starts the
+ * deferred ones once it is not
+ */
+void scale_for_pressure ( Server manager[], unsigned pressured );
+
+/**
+ * Returns how long the event loop may sleep before scaling again
+ */
+int next_scale_timeout ( Server manager[], unsigned pressured );
+
+/**
+ * Sets a server's limits right away, as a rule due now would
+ * @return 0 on success, -1 on error
+ */
+int scale_server ( char* tokens[], Server manager[] );
+
+/**
+ * Adds a daily rule setting a server's minimum
+ */
+int add_scale_rule ( char* tokens[] );
+
+/**
+ * Removes the rules of a server, or only the one due at a time of day
+ */
+int remove_scale_rules ( const char* name, const char* at );
+
+/**
+ * Applies the rules that came due
+ */
+void run_scale_rules ( Server manager[] );
+
+/**
+ * Returns how long the event loop may sleep before a rule is due
+ */
+int next_rule_timeout ();
+
+/**
+ * Displays every rule and when it is due next
+ */
+void display_schedule ();
+
+/**
+ * Runs a command line read by the agent, its output going to the client
+ */
+int run_agent_command ( char* line, int client_fd, bool* hang_up,
+                        void* ctx );
+
+/**
+ * Runs a batch of commands on some nodes, showing every node's output
+ */
+int on_nodes ( const char* targets, char* tokens[] );
+
+/**
+ * Displays the status of every node and the totals of the fleet
+ */
+void display_fleet ();
+
+/**
+ * Displays the state of every server and the totals of this node
+ */
+void display_node ( Server manager[] );
+
+/**
+ * Displays the state and crash history of every server
+ */
+void display_health ( Server manager[] );
+
+/**
+ * Keeps the options of a server so respawns get the same ones
+ * @return 0 on success, -1 if an option is invalid or there are too many
+ */
+int store_options ( Server* server, char* tokens[] );
+
+/**
+ * Displays the shared and private memory of every replica
+ */
+void display_memory ( Server manager[] );
+
+/**
+ * Finds the struct of the server with the given name
+ */
+Server* find_server ( const char* name, Server manager[] );
+
+/**
+ * Finds an unused server struct
+ */
+Server* free_slot ( Server manager[] );
+
+/**
+ * Releases a server struct once its server has shut down
+ */
+void release_struct ( Server* server );
 
 /**
  * Reads in user commands and parses them into tokens
 */
 int read_command (char* tokens[]);
 
+/**
+ * Executes one command entered by the user
+ */
+int execute_command ( char* tokens[], Server manager[] );
+
+/**
+ * Checks a command has the arguments it needs
+ * @return 0 if it may run, -1 otherwise
+ */
+int check_arguments ( char* tokens[] );
+
 /**
  * Displays a prompt for the user to input commands
 */
@@ -51,7 +278,12 @@ void display_prompt();
 /**
  * Displays the status of the system
  */
-void display_status();
+void display_status( Server manager[] );
+
+/**
+ * Displays the latency percentiles of every server
+ */
+void display_latency( Server manager[] );
 
 /**
  * Parses commands into arguments
@@ -73,9 +305,14 @@ pid_t search_server ( const char* name, Server manager[] );
  */
 pid_t create_process ( const char* name , Server manager[]);
 
+/**
+ * Signals a running server once its instance is up
+ */
+int signal_server ( Server* server, int sig );
+
 /**
  * Aborts one copy of the given server name 
  */
-void abort_process ( char* name, Server manager[]);
+int abort_process ( const char* name, Server manager[]);
 
 #endif
@@ -0,0 +1,275 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "metrics.h"
+
+/*****************************************************
+* Prometheus text format helpers and scrape endpoint
+* Author: Gloire Rubambiza
+* Version: 10/21/2017
+******************************************************/
+
+#define STAT_BUFFER_SIZE 512
+#define REQUEST_BUFFER_SIZE 1024
+
+/**
+ * Empties the buffer while keeping its memory
+ */
+void metrics_reset ( MetricsBuffer* buf ){
+  buf->len = 0;
+  if ( buf->data != NULL){
+    buf->data[0] = '\0';
+  }
+}
+
+/**
+ * Appends formatted text to the buffer, growing it when needed
+ */
+void metrics_printf ( MetricsBuffer* buf, const char* format, ... ){
+  va_list args;
+  while (1) {
+    size_t room = buf->cap - buf->len;
+    va_start(args, format);
+    int needed = vsnprintf(buf->data + buf->len, room, format, args);
+    va_end(args);
+    if ( needed < 0){
+      return;
+    }
+    if ( (size_t) needed < room){
+      buf->len += needed;
+      return;
+    }
+    size_t cap = buf->cap > 0 ? buf->cap * 2 : 4096;
+    while ( cap - buf->len <= (size_t) needed){
+      cap *= 2;
+    }
+    char* data = realloc(buf->data, cap);
+    if ( data == NULL){
+      return;
+    }
+    buf->data = data;
+    buf->cap = cap;
+  }
+}
+
+/**
+ * Appends the HELP and TYPE lines that open a metric family
+ */
+void metrics_family ( MetricsBuffer* buf, const char* name, const char* type,
+                      const char* help ){
+  metrics_printf(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * Appends a label value, escaping backslashes, quotes and newlines
+ */
+void metrics_label ( MetricsBuffer* buf, const char* value ){
+  const char* c;
+  for ( c = value; *c != '\0'; ++c){
+    if ( *c == '\\' || *c == '"'){
+      metrics_printf(buf, "\\%c", *c);
+    } else if ( *c == '\n'){
+      metrics_printf(buf, "\\n");
+    } else {
+      metrics_printf(buf, "%c", *c);
+    }
+  }
+}
+
+/**
+ * Reads the CPU time and resident memory of a process from /proc
+ * @param pid the process to look at
+ * @param cpu_seconds set to the user plus system time
+ * @param rss_bytes set to the resident set size
+ * @return 0 on success, -1 if the process is gone
+ */
+int read_proc_usage ( pid_t pid, double* cpu_seconds, long* rss_bytes ){
+  char path[64], stat[STAT_BUFFER_SIZE];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if ( fd < 0){
+    return -1;
+  }
+  ssize_t n = read(fd, stat, sizeof(stat) - 1);
+  close(fd);
+  if ( n <= 0){
+    return -1;
+  }
+  stat[n] = '\0';
+
+  // The command name may hold spaces, fields are counted after its ')'
+  char* fields = strrchr(stat, ')');
+  if ( fields == NULL){
+    return -1;
+  }
+  unsigned long utime, stime;
+  long rss;
+  if ( sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+              "%lu %lu %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+              &utime, &stime, &rss) != 3){
+    return -1;
+  }
+  *cpu_seconds = (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+  *rss_bytes = rss * sysconf(_SC_PAGESIZE);
+  return 0;
+}
+
+/**
+ * Reads how much of a process' resident memory is shared or private
+ * Pages a forked replica has not written to still count as shared.
+ * @param pid the process to look at
+ * @param shared_bytes set to the clean and dirty shared memory
+ * @param private_bytes set to the clean and dirty private memory
+ * @return 0 on success, -1 if the process is gone
+ */
+int read_proc_memory ( pid_t pid, long* shared_bytes, long* private_bytes ){
+  char path[64], line[STAT_BUFFER_SIZE];
+  snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int) pid);
+  FILE* rollup = fopen(path, "re");
+  if ( rollup == NULL){
+    return -1;
+  }
+  *shared_bytes = 0;
+  *private_bytes = 0;
+  while ( fgets(line, sizeof(line), rollup) != NULL){
+    long kb;
+    if ( sscanf(line, "Shared_Clean: %ld", &kb) == 1 ||
+         sscanf(line, "Shared_Dirty: %ld", &kb) == 1){
+      *shared_bytes += kb * 1024;
+    } else if ( sscanf(line, "Private_Clean: %ld", &kb) == 1 ||
+                sscanf(line, "Private_Dirty: %ld", &kb) == 1){
+      *private_bytes += kb * 1024;
+    }
+  }
+  fclose(rollup);
+  return 0;
+}
+
+/**
+ * Opens the loopback listener that serves the metrics
+ * @param port the port to listen on, 0 disables the endpoint
+ * @return the listening descriptor, -1 on error or when disabled
+ */
+int open_metrics_listener ( int port ){
+  if ( port <= 0){
+    return -1;
+  }
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if ( fd < 0){
+    return -1;
+  }
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if ( bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+       listen(fd, SOMAXCONN) < 0){
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Accepts a scrape into a free client, to be read once it sends
+ * @param listen_fd the metrics listener
+ * @param clients MAX_METRICS_CLIENTS scrapers
+ * @return 0 on success, -1 when none is free or accept failed
+ */
+int metrics_accept ( int listen_fd, MetricsClient clients[] ){
+  int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if ( conn < 0){
+    return -1;
+  }
+  int i;
+  for ( i = 0; i < MAX_METRICS_CLIENTS; ++i){
+    if ( clients[i].fd < 0){
+      clients[i].fd = conn;
+      metrics_reset(&clients[i].reply);
+      clients[i].sent = 0;
+      return 0;
+    }
+  }
+  close(conn); // The scraper fails this once and tries again next interval
+  return -1;
+}
+
+/**
+ * Reads what a scraper sent, without waiting for more
+ * The request itself is not parsed, every path returns the metrics.
+ * @param client the scraper, closed if it hung up
+ * @return 1 once a request arrived, 0 while none did, -1 if it hung up
+ */
+int metrics_read ( MetricsClient* client ){
+  char request[REQUEST_BUFFER_SIZE];
+  ssize_t len = read(client->fd, request, sizeof(request));
+  if ( len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                   errno == EINTR)){
+    return 0;
+  }
+  if ( len <= 0){
+    close(client->fd);
+    client->fd = -1;
+    return -1;
+  }
+  return 1;
+}
+
+/**
+ * Answers a scraper with the rendered buffer
+ * The answer is copied into the scraper's own reply, as the buffer is
+ * rendered again for the next scrape while a slow scraper still reads.
+ * @param client the scraper
+ * @param buf the rendered metrics
+ */
+void serve_metrics ( MetricsClient* client, const MetricsBuffer* buf ){
+  metrics_reset(&client->reply);
+  metrics_printf(&client->reply, "HTTP/1.1 200 OK\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Connection: close\r\n\r\n%.*s", buf->len, (int) buf->len,
+                 buf->data != NULL ? buf->data : "");
+  client->sent = 0;
+  metrics_write(client);
+}
+
+/**
+ * Sends what the scraper's socket takes of its answer, without waiting
+ * @param client the scraper, closed once sent or if it hung up
+ * @return 1 once sent, 0 while some is left, -1 if the scraper hung up
+ */
+int metrics_write ( MetricsClient* client ){
+  while ( client->sent < client->reply.len){
+    ssize_t n = send(client->fd, client->reply.data + client->sent,
+                     client->reply.len - client->sent, MSG_NOSIGNAL);
+    if ( n < 0 && errno == EINTR){
+      continue;
+    }
+    if ( n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+      return 0;
+    }
+    if ( n <= 0){
+      break;
+    }
+    client->sent += n;
+  }
+  int done = client->sent == client->reply.len && client->sent > 0 ? 1 : -1;
+  close(client->fd);
+  client->fd = -1;
+  metrics_reset(&client->reply);
+  client->sent = 0;
+  return done;
+}
@@ -0,0 +1,99 @@
+#ifndef H_METRICS
+#define H_METRICS
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+/***********************************************
+* Prometheus text exposition for the server manager
+* Scrapes are answered over plain HTTP on a loopback
+* port, rendered into a buffer reused between scrapes.
+* Author: Gloire Rubambiza
+* Version: 10/21/2017
+***********************************************/
+
+// Environment variable overriding the port metrics are served on
+#define METRICS_PORT_ENV "SCS_METRICS_PORT"
+#define DEFAULT_METRICS_PORT 9464
+#define MAX_METRICS_CLIENTS 4
+
+// A growable text buffer, kept between scrapes to avoid reallocating
+typedef struct MetricsBuffer {
+  char* data;
+  size_t len;
+  size_t cap;
+} MetricsBuffer;
+
+// A scraper's connection, and the answer still being sent to it
+typedef struct MetricsClient {
+  int fd;                              // -1 when unused
+  MetricsBuffer reply;                 // Empty until its request arrived
+  size_t sent;
+} MetricsClient;
+
+/**
+ * Empties the buffer while keeping its memory
+ */
+void metrics_reset ( MetricsBuffer* buf );
+
+/**
+ * Appends formatted text to the buffer
+ */
+void metrics_printf ( MetricsBuffer* buf, const char* format, ... );
+
+/**
+ * Appends the HELP and TYPE lines that open a metric family
+ */
+void metrics_family ( MetricsBuffer* buf, const char* name, const char* type,
+                      const char* help );
+
+/**
+ * Appends a label value, escaped as the text format requires
+ */
+void metrics_label ( MetricsBuffer* buf, const char* value );
+
+/**
+ * Reads the CPU time and resident memory of a process from /proc
+ * @return 0 on success, -1 if the process is gone
+ */
+int read_proc_usage ( pid_t pid, double* cpu_seconds, long* rss_bytes );
+
+/**
+ * Reads how much of a process' resident memory is shared or private
+ * @return 0 on success, -1 if the process is gone
+ */
+int read_proc_memory ( pid_t pid, long* shared_bytes, long* private_bytes );
+
+/**
+ * Opens the loopback listener that serves the metrics
+ * @return the listening descriptor, -1 on error or when disabled
+ */
+int open_metrics_listener ( int port );
+
+/**
+ * Accepts a scrape into a free client, to be read once it sends
+ * @param clients MAX_METRICS_CLIENTS scrapers
+ * @return 0 on success, -1 when none is free or accept failed
+ */
+int metrics_accept ( int listen_fd, MetricsClient clients[] );
+
+/**
+ * Reads what a scraper sent, without waiting for more
+ * @return 1 once a request arrived, 0 while none did, -1 if it hung up
+ */
+int metrics_read ( MetricsClient* client );
+
+/**
+ * Answers a scraper with the rendered buffer, sending what its socket
+ * takes now and the rest through metrics_write
+ */
+void serve_metrics ( MetricsClient* client, const MetricsBuffer* buf );
+
+/**
+ * Sends more of a scraper's answer, closing it once all of it is sent
+ * @return 1 once sent, 0 while some is left, -1 if the scraper hung up
+ */
+int metrics_write ( MetricsClient* client );
+
+#endif
@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "preload.h"
+
+/*****************************************************
+* Preloaded server state: configuration lookup table
+* and resident code pages, shared by zygote replicas
+* Author: Gloire Rubambiza
+* Version: 10/24/2017
+******************************************************/
+
+#define LINE_BUFFER_SIZE 512
+#define MIN_TABLE_CAPACITY 64
+
+/**
+ * FNV-1a hash of a key
+ */
+static uint64_t hash_key ( const char* key ){
+  uint64_t hash = 14695981039346656037ULL;
+  for ( ; *key != '\0'; ++key){
+    hash = (hash ^ (unsigned char) *key) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+/**
+ * Inserts or replaces a key, the table must have a free slot
+ */
+static void table_insert ( Preload* preload, char* key, char* value ){
+  size_t mask = preload->capacity - 1;
+  size_t i = hash_key(key) & mask;
+  while ( preload->table[i].key != NULL && strcmp(preload->table[i].key, key) != 0){
+    i = (i + 1) & mask;
+  }
+  if ( preload->table[i].key == NULL){
+    preload->entries++;
+  } else {
+    free(preload->table[i].key);
+    free(preload->table[i].value);
+  }
+  preload->table[i].key = key;
+  preload->table[i].value = value;
+}
+
+/**
+ * Doubles the table, rehashing every entry
+ */
+static int table_grow ( Preload* preload ){
+  ConfigEntry* old = preload->table;
+  size_t old_capacity = preload->capacity, i;
+  preload->capacity = old_capacity > 0 ? old_capacity * 2 : MIN_TABLE_CAPACITY;
+  preload->table = calloc(preload->capacity, sizeof(ConfigEntry));
+  if ( preload->table == NULL){
+    preload->table = old;
+    preload->capacity = old_capacity;
+    return -1;
+  }
+  preload->entries = 0;
+  for ( i = 0; i < old_capacity; ++i){
+    if ( old[i].key != NULL){
+      table_insert(preload, old[i].key, old[i].value);
+    }
+  }
+  free(old);
+  return 0;
+}
+
+/**
+ * Reads "key value" lines into the table, skipping blanks and # comments
+ */
+static int load_config ( Preload* preload, const char* config_path ){
+  FILE* config = fopen(config_path, "re");
+  if ( config == NULL){
+    return -1;
+  }
+  char line[LINE_BUFFER_SIZE];
+  while ( fgets(line, sizeof(line), config) != NULL){
+    char* key = strtok(line, " \t\n");
+    char* value = strtok(NULL, "\n");
+    if ( key == NULL || key[0] == '#'){
+      continue;
+    }
+    // Keep the load factor under a half so probes stay short
+    if ( (preload->entries + 1) * 2 > preload->capacity && table_grow(preload) < 0){
+      fclose(config);
+      return -1;
+    }
+    table_insert(preload, strdup(key), strdup(value != NULL ? value : ""));
+  }
+  fclose(config);
+  return 0;
+}
+
+/**
+ * Faults in every executable mapping of the process
+ * Touching the pages before forking makes them resident once, in the
+ * page cache, for all the replicas instead of on each one's first job.
+ * @return the number of bytes faulted in
+ */
+static size_t prefault_code (){
+  FILE* maps = fopen("/proc/self/maps", "re");
+  if ( maps == NULL){
+    return 0;
+  }
+  size_t total = 0;
+  long page = sysconf(_SC_PAGESIZE);
+  char line[LINE_BUFFER_SIZE];
+  while ( fgets(line, sizeof(line), maps) != NULL){
+    uintptr_t start, end;
+    char perms[5];
+    if ( sscanf(line, "%lx-%lx %4s", &start, &end, perms) != 3 ||
+         perms[0] != 'r' || perms[2] != 'x'){
+      continue;
+    }
+    // The vdso and vsyscall pages are special, leave them alone
+    if ( strstr(line, "[v") != NULL){
+      continue;
+    }
+    madvise((void*) start, end - start, MADV_WILLNEED);
+    volatile const char* byte;
+    for ( byte = (const char*) start; (uintptr_t) byte < end; byte += page){
+      (void) *byte;
+    }
+    total += end - start;
+  }
+  fclose(maps);
+  return total;
+}
+
+/**
+ * Loads the configuration into the lookup table and faults in code pages
+ * @param preload the state to fill
+ * @param config_path a file of "key value" lines, NULL for none
+ * @return 0 on success, -1 if the configuration could not be read
+ */
+int preload_state ( Preload* preload, const char* config_path ){
+  memset(preload, 0, sizeof(Preload));
+  if ( table_grow(preload) < 0){
+    return -1;
+  }
+  int result = 0;
+  if ( config_path != NULL){
+    result = load_config(preload, config_path);
+  }
+  preload->code_bytes = prefault_code();
+  preload->loaded = true;
+  return result;
+}
+
+/**
+ * Looks up a key of the configuration
+ * @return the value, NULL if the key is unknown
+ */
+const char* preload_lookup ( const Preload* preload, const char* key ){
+  if ( !preload->loaded){
+    return NULL;
+  }
+  size_t mask = preload->capacity - 1;
+  size_t i = hash_key(key) & mask;
+  while ( preload->table[i].key != NULL){
+    if ( strcmp(preload->table[i].key, key) == 0){
+      return preload->table[i].value;
+    }
+    i = (i + 1) & mask;
+  }
+  return NULL;
+}
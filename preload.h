@@ -0,0 +1,43 @@
+#ifndef H_PRELOAD
+#define H_PRELOAD
+#include <stddef.h>
+#include <stdbool.h>
+
+/***********************************************
+* State a server loads before serving jobs
+* In zygote mode the server loads it once and forks warm
+* replicas that share its pages copy-on-write, otherwise
+* every replica loads its own private copy after forking.
+* Author: Gloire Rubambiza
+* Version: 10/24/2017
+***********************************************/
+
+// One key of the server's configuration and the answer it maps to
+typedef struct ConfigEntry {
+  char* key;
+  char* value;
+} ConfigEntry;
+
+typedef struct Preload {
+  ConfigEntry* table;                  // Open addressing, capacity a power of 2
+  size_t capacity;
+  size_t entries;
+  size_t code_bytes;                   // Executable pages faulted in
+  bool loaded;
+} Preload;
+
+/**
+ * Loads the configuration into the lookup table and faults in code pages
+ * @param preload the state to fill
+ * @param config_path a file of "key value" lines, NULL for none
+ * @return 0 on success, -1 if the configuration could not be read
+ */
+int preload_state ( Preload* preload, const char* config_path );
+
+/**
+ * Looks up a key of the configuration
+ * @return the value, NULL if the key is unknown
+ */
+const char* preload_lookup ( const Preload* preload, const char* key );
+
+#endif
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "pressure.h"
+
+/*****************************************************
+* PSI triggers watched by the manager's event loop
+* A trigger is the line "some <stall> <window>" written to a
+* pressure file; the descriptor then raises POLLPRI each window
+* in which some task stalled for at least <stall> microseconds.
+* Author: Gloire Rubambiza
+* Version: 10/28/2017
+******************************************************/
+
+static const char* resource_names[PRESSURE_NUM_RESOURCES] = {
+  "cpu", "memory", "io"
+};
+
+/**
+ * Names a resource for messages
+ * @param resource the resource
+ * @return its name, as in the pressure files
+ */
+const char* pressure_name ( PressureResource resource ){
+  return resource_names[resource];
+}
+
+/**
+ * Opens a pressure file and writes our trigger to it
+ * @param path the pressure file
+ * @param trigger the trigger line
+ * @return the descriptor to poll, -1 when the file or PSI is missing
+ */
+static int open_trigger ( const char* path, const char* trigger ){
+  int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if ( fd < 0){
+    return -1;
+  }
+  if ( write(fd, trigger, strlen(trigger) + 1) < 0){
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Finds the directory of our cgroup in the unified hierarchy
+ * @param dir receives the directory
+ * @param size the size of dir
+ * @return 0 on success, -1 when we sit in the root or have no cgroup v2
+ */
+static int cgroup_dir ( char* dir, size_t size ){
+  FILE* file = fopen("/proc/self/cgroup", "r");
+  if ( file == NULL){
+    return -1;
+  }
+  char line[256], *path = NULL;
+  while ( fgets(line, sizeof(line), file) != NULL){
+    if ( strncmp(line, "0::", 3) == 0){
+      path = line + 3;
+      path[strcspn(path, "\n")] = '\0';
+      break;
+    }
+  }
+  fclose(file);
+  if ( path == NULL || strcmp(path, "/") == 0){ // The root is the host
+    return -1;
+  }
+
+  // Pure cgroup v2 mounts it on /sys/fs/cgroup, hybrid setups below it
+  const char* mounts[] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" };
+  int i;
+  for ( i = 0; i < 2; ++i){
+    snprintf(dir, size, "%s%s/cgroup.procs", mounts[i], path);
+    if ( access(dir, F_OK) == 0){
+      snprintf(dir, size, "%s%s", mounts[i], path);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Sets up triggers on the host's and our cgroup's pressure files
+ * The cgroup's catch a limit we hit before the host as a whole stalls.
+ * The threshold comes from SCS_PSI_THRESHOLD, as a percent of the window.
+ * A new trigger measures its first windows against a stall total of zero,
+ * so whatever stalled since boot may fire it; those windows are ignored.
+ * @param monitor the monitor to set up
+ * @param now the monotonic time in seconds
+ * @return the number of triggers, 0 when PSI is unavailable
+ */
+int pressure_init ( PressureMonitor* monitor, double now ){
+  memset(monitor, 0, sizeof(PressureMonitor));
+  monitor->settled_at = now + PRESSURE_HOLD_WINDOWS * PRESSURE_WINDOW_US / 1e6;
+  char* threshold_env = getenv(PRESSURE_THRESHOLD_ENV);
+  monitor->threshold = threshold_env != NULL ? atoi(threshold_env)
+                                             : DEFAULT_PRESSURE_THRESHOLD;
+  if ( monitor->threshold < 1){
+    monitor->threshold = 1;
+  } else if ( monitor->threshold > 100){
+    monitor->threshold = 100;
+  }
+
+  char trigger[64], path[512], cgroup[384];
+  snprintf(trigger, sizeof(trigger), "some %ld %d",
+           (long) PRESSURE_WINDOW_US / 100 * monitor->threshold,
+           PRESSURE_WINDOW_US);
+  bool in_cgroup = cgroup_dir(cgroup, sizeof(cgroup)) == 0;
+  int resource;
+  for ( resource = 0; resource < PRESSURE_NUM_RESOURCES; ++resource){
+    snprintf(path, sizeof(path), "/proc/pressure/%s", resource_names[resource]);
+    int fd = open_trigger(path, trigger);
+    if ( fd >= 0){
+      monitor->resources[monitor->num_fds] = resource;
+      monitor->fds[monitor->num_fds++] = fd;
+    }
+    if ( !in_cgroup){
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s.pressure", cgroup,
+             resource_names[resource]);
+    fd = open_trigger(path, trigger);
+    if ( fd >= 0){
+      monitor->resources[monitor->num_fds] = resource;
+      monitor->fds[monitor->num_fds++] = fd;
+    }
+  }
+  return monitor->num_fds;
+}
+
+/**
+ * Adds the triggers to a poll set, closed ones are skipped by poll
+ * @param monitor the monitor
+ * @param pfds receives up to MAX_PRESSURE_TRIGGERS entries
+ * @return the number of entries added
+ */
+int pressure_poll_fds ( PressureMonitor* monitor, struct pollfd* pfds ){
+  int i;
+  for ( i = 0; i < monitor->num_fds; ++i){
+    pfds[i] = (struct pollfd) { .fd = monitor->fds[i], .events = POLLPRI };
+  }
+  return monitor->num_fds;
+}
+
+/**
+ * Records the triggers that fired in a poll set filled by pressure_poll_fds()
+ * A resource stays under pressure until none of its triggers fired for
+ * PRESSURE_HOLD_WINDOWS windows.
+ * @param monitor the monitor
+ * @param pfds the poll set, after poll returned
+ * @param now the monotonic time in seconds
+ * @return a bit per resource under pressure, 1 << PressureResource
+ */
+unsigned pressure_check ( PressureMonitor* monitor, const struct pollfd* pfds,
+                          double now ){
+  int i;
+  for ( i = 0; pfds != NULL && i < monitor->num_fds; ++i){
+    if ( pfds[i].revents & POLLERR){ // Our cgroup went away
+      close(monitor->fds[i]);
+      monitor->fds[i] = -1;
+    } else if ( pfds[i].revents & POLLPRI && now >= monitor->settled_at){
+      monitor->fired_at[monitor->resources[i]] = now;
+    }
+  }
+
+  double hold = PRESSURE_HOLD_WINDOWS * PRESSURE_WINDOW_US / 1e6;
+  unsigned pressured = 0;
+  for ( i = 0; i < PRESSURE_NUM_RESOURCES; ++i){
+    if ( monitor->fired_at[i] > 0 && now - monitor->fired_at[i] < hold){
+      pressured |= 1u << i;
+    }
+  }
+  return pressured;
+}
+
+/**
+ * Returns how long until the pressure seen so far is over
+ * @param monitor the monitor
+ * @param now the monotonic time in seconds
+ * @return the timeout in milliseconds, -1 if there is none
+ */
+int pressure_timeout ( const PressureMonitor* monitor, double now ){
+  double hold = PRESSURE_HOLD_WINDOWS * PRESSURE_WINDOW_US / 1e6, last = 0;
+  int i;
+  for ( i = 0; i < PRESSURE_NUM_RESOURCES; ++i){
+    if ( monitor->fired_at[i] > last){
+      last = monitor->fired_at[i];
+    }
+  }
+  if ( last == 0 || now - last >= hold){
+    return -1;
+  }
+  return (int) ((last + hold - now) * 1000) + 1;
+}
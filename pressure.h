@@ -0,0 +1,80 @@
+#ifndef H_PRESSURE
+#define H_PRESSURE
+#include <stdbool.h>
+#include <poll.h>
+
+/***********************************************
+* Host pressure as seen by the manager's event loop
+* PSI triggers on /proc/pressure and on the manager's own
+* cgroup make their descriptors raise POLLPRI whenever tasks
+* stalled on CPU, memory or I/O for long enough in a window,
+* so the manager learns of pressure without polling files.
+* Author: Gloire Rubambiza
+* Version: 10/28/2017
+***********************************************/
+
+// Environment variable setting the share of a window, in percent, tasks
+// may stall on a resource before the host counts as under pressure
+#define PRESSURE_THRESHOLD_ENV "SCS_PSI_THRESHOLD"
+#define DEFAULT_PRESSURE_THRESHOLD 10
+
+// PSI triggers are evaluated over windows of this many microseconds,
+// the shortest unprivileged processes may ask for
+#define PRESSURE_WINDOW_US 2000000
+
+// A trigger fires at most once per window, so pressure is only over once
+// none fired for this many windows
+#define PRESSURE_HOLD_WINDOWS 2
+
+#define MAX_PRESSURE_TRIGGERS 6
+
+typedef enum PressureResource {
+  PRESSURE_CPU,
+  PRESSURE_MEMORY,
+  PRESSURE_IO,
+  PRESSURE_NUM_RESOURCES
+} PressureResource;
+
+typedef struct PressureMonitor {
+  int fds[MAX_PRESSURE_TRIGGERS];      // One trigger per file, -1 once closed
+  PressureResource resources[MAX_PRESSURE_TRIGGERS];
+  int num_fds;
+  int threshold;                       // Percent of the window
+  double fired_at[PRESSURE_NUM_RESOURCES]; // Monotonic seconds, 0 for never
+  double settled_at;                   // Triggers firing before are ignored
+} PressureMonitor;
+
+/**
+ * Sets up triggers on the host's and our cgroup's pressure files
+ * @param now the monotonic time in seconds
+ * @return the number of triggers, 0 when PSI is unavailable
+ */
+int pressure_init ( PressureMonitor* monitor, double now );
+
+/**
+ * Adds the triggers to a poll set
+ * @param pfds receives up to MAX_PRESSURE_TRIGGERS entries
+ * @return the number of entries added
+ */
+int pressure_poll_fds ( PressureMonitor* monitor, struct pollfd* pfds );
+
+/**
+ * Records the triggers that fired in a poll set filled by pressure_poll_fds()
+ * @param now the monotonic time in seconds
+ * @return a bit per resource under pressure, 1 << PressureResource
+ */
+unsigned pressure_check ( PressureMonitor* monitor, const struct pollfd* pfds,
+                          double now );
+
+/**
+ * Returns how long until the pressure seen so far is over
+ * @return the timeout in milliseconds, -1 if there is none
+ */
+int pressure_timeout ( const PressureMonitor* monitor, double now );
+
+/**
+ * Names a resource for messages
+ */
+const char* pressure_name ( PressureResource resource );
+
+#endif
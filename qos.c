@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "qos.h"
+
+/*****************************************************
+* Scheduling, nice value and I/O priority of each QoS class
+* Author: Gloire Rubambiza
+* Version: 10/29/2017
+******************************************************/
+
+// glibc has no wrapper for ioprio_set(), nor its constants
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+typedef struct QosPolicy {
+  const char* name;
+  int policy;                          // SCHED_OTHER, SCHED_BATCH or SCHED_IDLE
+  int nice;
+  int io_class;
+  int io_level;                        // 0 is served first, 7 last
+} QosPolicy;
+
+// Raising priority above the manager's needs CAP_SYS_NICE, without it a
+// critical server still gets the best I/O priority of its class
+static const QosPolicy policies[QOS_NUM_CLASSES] = {
+  [QOS_STANDARD] = {"standard", SCHED_OTHER, 0, IOPRIO_CLASS_BE, 4},
+  [QOS_CRITICAL] = {"critical", SCHED_OTHER, -5, IOPRIO_CLASS_BE, 0},
+  [QOS_BATCH]    = {"batch", SCHED_BATCH, 10, IOPRIO_CLASS_BE, 7},
+  [QOS_IDLE]     = {"idle", SCHED_IDLE, 19, IOPRIO_CLASS_IDLE, 0}
+};
+
+/**
+ * Parses the value of a qos= option
+ * @param name the class name
+ * @return the class, -1 for unknown names
+ */
+int qos_parse ( const char* name ){
+  int qos;
+  for ( qos = 0; qos < QOS_NUM_CLASSES; ++qos){
+    if ( strcmp(name, policies[qos].name) == 0){
+      return qos;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Names a class as the qos= option spells it
+ * @param qos the class
+ * @return its name
+ */
+const char* qos_name ( QosClass qos ){
+  return policies[qos].name;
+}
+
+/**
+ * Parses a CPU list such as "0,2-3" into a set
+ * @return 0 on success, -1 if the list is malformed or empty
+ */
+static int parse_cpus ( const char* list, cpu_set_t* set ){
+  CPU_ZERO(set);
+  const char* p = list;
+  while ( *p != '\0'){
+    char* end;
+    long first = strtol(p, &end, 10), last = first;
+    if ( end == p){
+      return -1;
+    }
+    if ( *end == '-'){
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if ( end == p){
+        return -1;
+      }
+    }
+    if ( first < 0 || last < first || last >= CPU_SETSIZE){
+      return -1;
+    }
+    for ( ; first <= last; ++first){
+      CPU_SET(first, set);
+    }
+    p = *end == ',' ? end + 1 : end;
+    if ( *end != ',' && *end != '\0'){
+      return -1;
+    }
+  }
+  return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/**
+ * Checks the value of a cpus= option, before anything is started with it
+ * @param list a list such as "0,2-3"
+ * @return 0 for a valid CPU list, -1 otherwise
+ */
+int qos_check_cpus ( const char* list ){
+  cpu_set_t set;
+  return parse_cpus(list, &set);
+}
+
+/**
+ * Applies a class to the calling thread, which its children inherit
+ * Each part is attempted even when another fails, so an unprivileged
+ * server still gets whatever it may set for itself.
+ * @param qos the class
+ * @param cpus a list such as "0,2-3" to run on, NULL for any CPU
+ * @return 0 on success, -1 if some part could not be applied
+ */
+int qos_apply ( QosClass qos, const char* cpus ){
+  const QosPolicy* policy = &policies[qos];
+  int result = 0;
+
+  struct sched_param param = { .sched_priority = 0 };
+  if ( sched_setscheduler(0, policy->policy, &param) < 0){
+    perror("qos_apply: sched_setscheduler");
+    result = -1;
+  }
+  // SCHED_IDLE ignores the nice value, it is still kept for ps and top
+  if ( setpriority(PRIO_PROCESS, 0, policy->nice) < 0){
+    perror("qos_apply: setpriority");
+    result = -1;
+  }
+  int ioprio = policy->io_class << IOPRIO_CLASS_SHIFT | policy->io_level;
+  if ( syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) < 0){
+    perror("qos_apply: ioprio_set");
+    result = -1;
+  }
+
+  if ( cpus != NULL){
+    cpu_set_t set;
+    if ( parse_cpus(cpus, &set) < 0){
+      fprintf(stderr, "qos_apply: invalid CPU list %s\n", cpus);
+      result = -1;
+    } else if ( sched_setaffinity(0, sizeof(set), &set) < 0){
+      perror("qos_apply: sched_setaffinity");
+      result = -1;
+    }
+  }
+  return result;
+}
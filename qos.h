@@ -0,0 +1,48 @@
+#ifndef H_QOS
+#define H_QOS
+
+/***********************************************
+* Quality of service classes of the servers
+* A server applies its class to itself before replicating,
+* so every replica inherits it: scheduling policy and nice
+* value for the CPU, the I/O priority, and optionally the
+* CPUs it may run on. Respawns pass the same options, so a
+* respawned server comes back under the same class.
+* Author: Gloire Rubambiza
+* Version: 10/29/2017
+***********************************************/
+
+typedef enum QosClass {
+  QOS_STANDARD,                        // As started, the default
+  QOS_CRITICAL,                        // Latency-critical, ahead of the rest
+  QOS_BATCH,                           // Throughput, yields to interactive work
+  QOS_IDLE,                            // Only runs on otherwise idle CPUs
+  QOS_NUM_CLASSES
+} QosClass;
+
+/**
+ * Parses the value of a qos= option
+ * @return the class, -1 for unknown names
+ */
+int qos_parse ( const char* name );
+
+/**
+ * Names a class as the qos= option spells it
+ */
+const char* qos_name ( QosClass qos );
+
+/**
+ * Checks the value of a cpus= option
+ * @return 0 for a valid CPU list, -1 otherwise
+ */
+int qos_check_cpus ( const char* list );
+
+/**
+ * Applies a class to the calling thread, which its children inherit
+ * @param qos the class
+ * @param cpus a list such as "0,2-3" to run on, NULL for any CPU
+ * @return 0 on success, -1 if some part could not be applied
+ */
+int qos_apply ( QosClass qos, const char* cpus );
+
+#endif
@@ -0,0 +1,518 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "agent.h"
+#include "scs.h"
+
+/*****************************************************
+* libscs, the client library of the server manager
+* Commands are written to the agent as lines, and each answer
+* is the command's output followed by an end mark carrying its
+* status. The agent answers in order, so the callbacks wait in
+* a FIFO ring and the oldest one owns the output being read.
+* Author: Gloire Rubambiza
+* Version: 10/31/2017
+******************************************************/
+
+// A command sent and not answered yet
+typedef struct ScsPending {
+  ScsCallback callback;
+  void* arg;
+} ScsPending;
+
+struct ScsClient {
+  int fd;                              // -1 once disconnected
+  bool connecting;                     // Until the non-blocking connect ends
+  char* out;                           // Command lines not sent yet
+  size_t out_len, out_cap;
+  char in[AGENT_LINE_SIZE];            // Reply bytes not yet split in lines
+  size_t in_len;
+  char* output;                        // Output of the oldest pending command
+  size_t output_len, output_cap;
+  ScsPending* pending;                 // Ring of the commands sent
+  int head, count, capacity;
+};
+
+/**
+ * Grows a buffer to hold at least the given size
+ * @return 0 on success, -1 when out of memory
+ */
+static int reserve ( char** buf, size_t* cap, size_t size ){
+  if ( size <= *cap){
+    return 0;
+  }
+  size_t new_cap = *cap > 0 ? *cap : 256;
+  while ( new_cap < size){
+    new_cap *= 2;
+  }
+  char* grown = realloc(*buf, new_cap);
+  if ( grown == NULL){
+    return -1;
+  }
+  *buf = grown;
+  *cap = new_cap;
+  return 0;
+}
+
+/**
+ * Starts connecting to a manager's agent
+ * The connect does not block, commands queued meanwhile go out once
+ * it is done.
+ * @param host the manager's host
+ * @param port the port of its agent, as in SCS_AGENT_PORT
+ * @return the client, NULL on error
+ */
+ScsClient* scs_connect ( const char* host, const char* port ){
+  struct addrinfo hints, *addrs, *addr;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ( getaddrinfo(host, port, &hints, &addrs) != 0){
+    return NULL;
+  }
+  int fd = -1;
+  bool connecting = false;
+  for ( addr = addrs; addr != NULL; addr = addr->ai_next){
+    fd = socket(addr->ai_family,
+                addr->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                addr->ai_protocol);
+    if ( fd < 0){
+      continue;
+    }
+    if ( connect(fd, addr->ai_addr, addr->ai_addrlen) == 0){
+      break;
+    } else if ( errno == EINPROGRESS){
+      connecting = true;
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addrs);
+  if ( fd < 0){
+    return NULL;
+  }
+
+  ScsClient* client = calloc(1, sizeof(ScsClient));
+  if ( client == NULL){
+    close(fd);
+    return NULL;
+  }
+  client->fd = fd;
+  client->connecting = connecting;
+  return client;
+}
+
+/**
+ * Returns the descriptor to poll, -1 once disconnected
+ * @param client the client
+ * @return the descriptor
+ */
+int scs_fd ( const ScsClient* client ){
+  return client->fd;
+}
+
+/**
+ * Returns the poll events to wait for on scs_fd()
+ * @param client the client
+ * @return POLLIN, with POLLOUT while there is something to send
+ */
+short scs_events ( const ScsClient* client ){
+  if ( client->connecting || client->out_len > 0){
+    return POLLIN | POLLOUT;
+  }
+  return POLLIN;
+}
+
+/**
+ * Returns the number of commands not answered yet
+ * @param client the client
+ * @return the number of commands
+ */
+int scs_pending ( const ScsClient* client ){
+  return client->count;
+}
+
+/**
+ * Removes the oldest pending command and runs its callback
+ * @param client the client
+ * @param status the command's status
+ */
+static void complete ( ScsClient* client, int status ){
+  ScsPending done = client->pending[client->head];
+  client->head = (client->head + 1) % client->capacity;
+  client->count--;
+
+  if ( done.callback != NULL){
+    done.callback(client, status,
+                  client->output != NULL ? client->output : "", done.arg);
+  }
+  client->output_len = 0;
+  if ( client->output != NULL){
+    client->output[0] = '\0';
+  }
+}
+
+/**
+ * Closes the connection and fails every command not answered yet
+ * @param client the client
+ */
+static void disconnect ( ScsClient* client ){
+  if ( client->fd >= 0){
+    close(client->fd);
+  }
+  client->fd = -1;
+  client->connecting = false;
+  client->out_len = 0;
+  client->output_len = 0;
+  while ( client->count > 0){
+    complete(client, SCS_DISCONNECTED);
+  }
+}
+
+/**
+ * Adds a line of output to the oldest pending command's
+ * @return 0 on success, -1 when out of memory
+ */
+static int add_output ( ScsClient* client, const char* line, size_t len ){
+  if ( reserve(&client->output, &client->output_cap,
+               client->output_len + len + 2) < 0){
+    return -1;
+  }
+  memcpy(client->output + client->output_len, line, len);
+  client->output_len += len;
+  client->output[client->output_len++] = '\n';
+  client->output[client->output_len] = '\0';
+  return 0;
+}
+
+/**
+ * Tells whether a line is an end mark, and the status it carries
+ * @param line the line, without its newline
+ * @param status receives the status
+ * @return true for an end mark
+ */
+static bool end_mark ( const char* line, int* status ){
+  size_t len = sizeof(AGENT_END_MARK) - 1;
+  if ( strncmp(line, AGENT_END_MARK, len) != 0 ||
+       (line[len] != '\0' && line[len] != ' ')){
+    return false;
+  }
+  *status = atoi(line + len);
+  return true;
+}
+
+/**
+ * Splits the bytes read into lines, completing a command per end mark
+ * Lines that arrive while no command is pending are not ours, so they
+ * are dropped.
+ * @param client the client
+ * @return the number of commands completed
+ */
+static int read_lines ( ScsClient* client ){
+  int completed = 0, status;
+  char* line = client->in, *end;
+  while ( (end = memchr(line, '\n',
+                        client->in + client->in_len - line)) != NULL){
+    *end = '\0';
+    if ( end_mark(line, &status)){
+      if ( client->count > 0){
+        complete(client, status);
+        completed++;
+      }
+    } else if ( client->count > 0){
+      add_output(client, line, end - line);
+    }
+    line = end + 1;
+  }
+  client->in_len -= line - client->in;
+  memmove(client->in, line, client->in_len);
+  if ( client->in_len == sizeof(client->in)){ // A line longer than we keep
+    if ( client->count > 0){
+      add_output(client, client->in, client->in_len);
+    }
+    client->in_len = 0;
+  }
+  return completed;
+}
+
+/**
+ * Sends as much of the queued command lines as the socket takes
+ * @return 0 on success, -1 on error
+ */
+static int flush ( ScsClient* client ){
+  size_t sent = 0;
+  while ( sent < client->out_len){
+    ssize_t n = send(client->fd, client->out + sent, client->out_len - sent,
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+    if ( n < 0 && errno == EINTR){
+      continue;
+    }
+    if ( n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+      break;
+    }
+    if ( n <= 0){
+      return -1;
+    }
+    sent += n;
+  }
+  client->out_len -= sent;
+  memmove(client->out, client->out + sent, client->out_len);
+  return 0;
+}
+
+/**
+ * Sends what is queued and runs the callbacks of the commands answered
+ * Call it whenever poll reports scs_events() on scs_fd().
+ * @param client the client
+ * @return the number of callbacks run, -1 once disconnected
+ */
+int scs_process ( ScsClient* client ){
+  if ( client->fd < 0){
+    return -1;
+  }
+  if ( client->connecting){
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if ( getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 ||
+         error != 0){
+      disconnect(client);
+      return -1;
+    }
+    struct pollfd pfd = { .fd = client->fd, .events = POLLOUT };
+    if ( poll(&pfd, 1, 0) <= 0){ // Not connected yet
+      return 0;
+    }
+    client->connecting = false;
+  }
+  if ( flush(client) < 0){
+    disconnect(client);
+    return -1;
+  }
+
+  int completed = 0;
+  for ( ; ; ){
+    ssize_t n = recv(client->fd, client->in + client->in_len,
+                     sizeof(client->in) - client->in_len, MSG_DONTWAIT);
+    if ( n < 0 && errno == EINTR){
+      continue;
+    }
+    if ( n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+      break;
+    }
+    if ( n <= 0){
+      completed += read_lines(client);
+      disconnect(client);
+      return -1;
+    }
+    client->in_len += n;
+    completed += read_lines(client);
+    // Callbacks may have queued more, send it along with this round
+    if ( client->out_len > 0 && flush(client) < 0){
+      disconnect(client);
+      return -1;
+    }
+  }
+  return completed;
+}
+
+/**
+ * Returns the monotonic time in milliseconds
+ */
+static long long now_ms (){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/**
+ * Waits until every command sent was answered, running their callbacks
+ * For programs without an event loop of their own.
+ * @param client the client
+ * @param timeout_ms the longest wait, -1 for no limit
+ * @return 0 when none is left, -1 on timeout or once disconnected
+ */
+int scs_wait ( ScsClient* client, int timeout_ms ){
+  long long deadline = now_ms() + timeout_ms;
+  while ( client->count > 0){
+    int wait = -1;
+    if ( timeout_ms >= 0){
+      long long left = deadline - now_ms();
+      if ( left <= 0){
+        return -1;
+      }
+      wait = (int) left;
+    }
+    struct pollfd pfd = { .fd = client->fd, .events = scs_events(client) };
+    if ( poll(&pfd, 1, wait) < 0 && errno != EINTR){
+      return -1;
+    }
+    if ( scs_process(client) < 0){
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Queues a command line, as typed at the manager's prompt
+ * The line is sent at once if the socket takes it, the rest on the next
+ * scs_process().
+ * @param client the client
+ * @param line the command, without a newline
+ * @param callback receives the answer, may be NULL
+ * @param arg passed to callback
+ * @return 0 on success, -1 on error
+ */
+int scs_command ( ScsClient* client, const char* line, ScsCallback callback,
+                  void* arg ){
+  size_t len = strlen(line);
+  // The agent drops lines longer than its buffer and would never answer
+  if ( client->fd < 0 || len == 0 || len >= AGENT_LINE_SIZE - 1 ||
+       strchr(line, '\n') != NULL){
+    return -1;
+  }
+  if ( client->count == client->capacity){
+    int capacity = client->capacity > 0 ? client->capacity * 2 : 16;
+    ScsPending* grown = realloc(client->pending,
+                                capacity * sizeof(ScsPending));
+    if ( grown == NULL){
+      return -1;
+    }
+    // Unwrap the ring into the grown array
+    int i;
+    for ( i = 0; i < client->head + client->count - client->capacity; ++i){
+      grown[client->capacity + i] = grown[i];
+    }
+    client->pending = grown;
+    client->capacity = capacity;
+  }
+  if ( reserve(&client->out, &client->out_cap, client->out_len + len + 1) < 0){
+    return -1;
+  }
+  memcpy(client->out + client->out_len, line, len);
+  client->out_len += len;
+  client->out[client->out_len++] = '\n';
+
+  int tail = (client->head + client->count) % client->capacity;
+  client->pending[tail] = (ScsPending) { callback, arg };
+  client->count++;
+  if ( !client->connecting && flush(client) < 0){
+    disconnect(client);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Formats a command line and queues it
+ * @return 0 on success, -1 on error
+ */
+static int send_format ( ScsClient* client, ScsCallback callback, void* arg,
+                         const char* format, ... ){
+  char line[AGENT_LINE_SIZE];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if ( len < 0 || len >= (int) sizeof(line)){
+    return -1;
+  }
+  return scs_command(client, line, callback, arg);
+}
+
+/**
+ * Queues the creation of a server
+ * @param client the client
+ * @param name the server's name
+ * @param min the minimum number of replicas
+ * @param max the maximum number of replicas
+ * @param args the port and options that follow max, as for createServer,
+ *        or NULL
+ * @param callback receives the answer, may be NULL
+ * @param arg passed to callback
+ * @return 0 on success, -1 on error
+ */
+int scs_create_server ( ScsClient* client, const char* name, int min, int max,
+                        const char* args, ScsCallback callback, void* arg ){
+  return send_format(client, callback, arg, "createServer %s %d %d%s%s", name,
+                     min, max, args != NULL ? " " : "",
+                     args != NULL ? args : "");
+}
+
+/**
+ * Queues the shutdown of a server and all its replicas
+ * @return 0 on success, -1 on error
+ */
+int scs_abort_server ( ScsClient* client, const char* name,
+                       ScsCallback callback, void* arg ){
+  return send_format(client, callback, arg, "abortServer %s", name);
+}
+
+/**
+ * Queues the start of one more replica of a server
+ * Under host pressure the manager defers it, which still succeeds.
+ * @return 0 on success, -1 on error
+ */
+int scs_create_process ( ScsClient* client, const char* name,
+                         ScsCallback callback, void* arg ){
+  return send_format(client, callback, arg, "createProcess %s", name);
+}
+
+/**
+ * Queues the retirement of one replica of a server
+ * @return 0 on success, -1 on error
+ */
+int scs_abort_process ( ScsClient* client, const char* name,
+                        ScsCallback callback, void* arg ){
+  return send_format(client, callback, arg, "abortProcess %s", name);
+}
+
+/**
+ * Queues new limits for a server, applied at once
+ * It sets the target in one command, where createProcess and
+ * abortProcess would take one per replica.
+ * @param client the client
+ * @param name the server's name
+ * @param min the replicas to run at least
+ * @param max the most replicas, 0 to keep the current one
+ * @return 0 on success, -1 on error
+ */
+int scs_scale ( ScsClient* client, const char* name, int min, int max,
+                ScsCallback callback, void* arg ){
+  if ( max > 0){
+    return send_format(client, callback, arg, "scaleServer %s %d %d", name,
+                       min, max);
+  }
+  return send_format(client, callback, arg, "scaleServer %s %d", name, min);
+}
+
+/**
+ * Queues a status request, answered with the manager's nodeStatus lines
+ * @return 0 on success, -1 on error
+ */
+int scs_status ( ScsClient* client, ScsCallback callback, void* arg ){
+  return scs_command(client, "nodeStatus", callback, arg);
+}
+
+/**
+ * Disconnects and frees the client
+ * Callbacks of commands not answered yet run with SCS_DISCONNECTED.
+ * @param client the client
+ */
+void scs_close ( ScsClient* client ){
+  disconnect(client);
+  free(client->out);
+  free(client->output);
+  free(client->pending);
+  free(client);
+}
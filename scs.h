@@ -0,0 +1,129 @@
+#ifndef H_SCS
+#define H_SCS
+#include <stdbool.h>
+
+/***********************************************
+* libscs, the client library of the server manager
+* Embeds control of a running manager in another program. It
+* talks to the manager's agent (see agent.h) over one TCP
+* connection and never blocks: commands are queued and return
+* at once, the caller polls scs_fd() for scs_events() in its
+* own event loop and calls scs_process(), which runs the
+* callback of every command answered, in the order sent.
+* Author: Gloire Rubambiza
+* Version: 10/31/2017
+***********************************************/
+
+// Status a callback gets for a command that will never be answered,
+// because the connection was lost or closed first
+#define SCS_DISCONNECTED -2
+
+typedef struct ScsClient ScsClient;
+
+// Receives the status of a command, 0 on success and -1 if the manager
+// refused it, and what the command printed. The output is only valid
+// during the call. A callback may queue commands, but not wait, process
+// or close the client.
+typedef void (*ScsCallback) ( ScsClient* client, int status,
+                              const char* output, void* arg );
+
+/**
+ * Starts connecting to a manager's agent
+ * @param host the manager's host
+ * @param port the port of its agent, as in SCS_AGENT_PORT
+ * @return the client, NULL on error
+ */
+ScsClient* scs_connect ( const char* host, const char* port );
+
+/**
+ * Returns the descriptor to poll, -1 once disconnected
+ */
+int scs_fd ( const ScsClient* client );
+
+/**
+ * Returns the poll events to wait for on scs_fd()
+ */
+short scs_events ( const ScsClient* client );
+
+/**
+ * Sends what is queued and runs the callbacks of the commands answered
+ * @return the number of callbacks run, -1 once disconnected
+ */
+int scs_process ( ScsClient* client );
+
+/**
+ * Waits until every command sent was answered, running their callbacks
+ * @param timeout_ms the longest wait, -1 for no limit
+ * @return 0 when none is left, -1 on timeout or once disconnected
+ */
+int scs_wait ( ScsClient* client, int timeout_ms );
+
+/**
+ * Returns the number of commands not answered yet
+ */
+int scs_pending ( const ScsClient* client );
+
+/**
+ * Queues a command line, as typed at the manager's prompt
+ * @param line the command, without a newline
+ * @param callback receives the answer, may be NULL
+ * @param arg passed to callback
+ * @return 0 on success, -1 on error
+ */
+int scs_command ( ScsClient* client, const char* line, ScsCallback callback,
+                  void* arg );
+
+/**
+ * Queues the creation of a server
+ * @param args the port and options that follow max, as for createServer,
+ *        or NULL
+ * @return 0 on success, -1 on error
+ */
+int scs_create_server ( ScsClient* client, const char* name, int min, int max,
+                        const char* args, ScsCallback callback, void* arg );
+
+/**
+ * Queues the shutdown of a server and all its replicas
+ * @return 0 on success, -1 on error
+ */
+int scs_abort_server ( ScsClient* client, const char* name,
+                       ScsCallback callback, void* arg );
+
+/**
+ * Queues the start of one more replica of a server
+ * @return 0 on success, -1 on error
+ */
+int scs_create_process ( ScsClient* client, const char* name,
+                         ScsCallback callback, void* arg );
+
+/**
+ * Queues the retirement of one replica of a server
+ * @return 0 on success, -1 on error
+ */
+int scs_abort_process ( ScsClient* client, const char* name,
+                        ScsCallback callback, void* arg );
+
+/**
+ * Queues new limits for a server, applied at once
+ * Replicas below the minimum are started, one at a time and only once
+ * host pressure allows, and those above it retired, in one command.
+ * @param min the replicas to run at least
+ * @param max the most replicas, 0 to keep the current one
+ * @return 0 on success, -1 on error
+ */
+int scs_scale ( ScsClient* client, const char* name, int min, int max,
+                ScsCallback callback, void* arg );
+
+/**
+ * Queues a status request, answered with the manager's nodeStatus lines
+ * @return 0 on success, -1 on error
+ */
+int scs_status ( ScsClient* client, ScsCallback callback, void* arg );
+
+/**
+ * Disconnects and frees the client
+ * Callbacks of commands not answered yet run with SCS_DISCONNECTED.
+ */
+void scs_close ( ScsClient* client );
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -5,9 +6,31 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <signal.h>
-#define MAX_REPLICAS 10
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <semaphore.h>
+#include <stdint.h>
 #define ONCE 1
+#define LISTEN_BACKLOG 128
+#define JOB_BUFFER_SIZE 256
+#define THREAD_STACK_SIZE (64 * 1024)
+#define IO_BATCH 64
+#define BUSY_REPLY "BUSY\n"
+#define STOP_NOW 0x1000000              // Written to a stop eventfd, retire is 1
+#define ACCEPT_BACKOFF_MS 100           // Pause after an accept error that lasts
 #include "server.h"
+#include "fdpass.h"
+#include "stats.h"
+#include "eventlog.h"
+#include "preload.h"
+#include "coroutine.h"
 #include <time.h>
 
 /*****************************************************
@@ -19,43 +42,147 @@
 // Declare all the children for ease of sending them signals
 Children child_pids[MAX_REPLICAS];
 
+// Listening sockets shared by all replicas, either inherited or bound here
+int listen_fds[MAX_PASSED_FDS];
+int num_listen_fds = 0;
+
+// Statistics shared with the manager, and the slot a replica writes to
+ServerStats* stats = NULL;
+__thread int my_slot = -1;
+
+// Every replica polls its own eventfd: 1 asks it to retire, STOP_NOW to
+// stop at once. The server writes it for threads, a process replica's
+// handlers write it on SIGTERM and SIGUSR1.
+__thread int my_stop_fd = -1;
+
+// Work the handlers defer to the main loop, as forking, joining, flushing
+// the event log and exiting are not safe from a handler
+volatile sig_atomic_t pending_replicas = 0;
+volatile sig_atomic_t pending_retires = 0;
+volatile sig_atomic_t shutdown_requested = 0;
+
+// Our end of the control socket, replicas report overload on it
+int control_sock = -1;
+
+// Name this server was created under, attached to its events
+const char* server_name = NULL;
+
+// Options of this server and the state its jobs read
+ServerOptions options;
+Preload preloaded;
+
 
 /**
  * General signal handler to handle SIGUSR1, SIGUSR2, SIGINT signals.
+ * It only records what was asked, the main loop carries it out.
  * @param sigNum is the received signal
  */
 void server_sig_handler (int sigNum) {
     if (sigNum == SIGINT) {
-        printf("We got a SIGUSR1!\n");
+        eventlog_emit(LOG_WARN, EV_SERVER_INTERRUPTED, server_name, 0, 0);
     }
     if (sigNum == SIGUSR2) {
-        pid_t parent_pid = getpid();
-        replicate(ONCE, &parent_pid, child_pids);
-    }
-    if (sigNum == SIGUSR1) { // Gracefully exit when SIGUSR1 is received
-        pid_t process_pid = getpid();
-        printf ("[Replica]: Received an SIGUSR1 signal from server manager.\n");
-        printf("[Replica]: My process id is %d, I am shutting down\n\n", process_pid);
-	printf ("Sending kill signals to all my children....\n\n");
-	int i;
-        for (i = 0; i < MAX_REPLICAS; ++i){
-          pid_t current_child = child_pids[i].child_pid;
-          //deallocate_child(&child_pids[i]);
-          kill(current_child, SIGUSR1);
-	  waitpid(current_child, NULL, 0);
-        }
-        exit(1);
+        pending_replicas++;
+    } else if (sigNum == RETIRE_SIGNAL) {
+        pending_retires++;
+    } else if (sigNum == SIGUSR1) { // Gracefully exit when SIGUSR1 is received
+        shutdown_requested = 1;
     }
 }
 
+/**
+ * Stops every process replica and waits for it, before the server exits
+ */
+void stop_replica_processes () {
+  int i;
+  for (i = 0; i < MAX_REPLICAS; ++i){
+    if (!child_pids[i].taken) { // pid 0 would signal the whole group
+      continue;
+    }
+    pid_t current_child = child_pids[i].child_pid;
+    kill(current_child, SIGUSR1);
+    if (waitpid(current_child, NULL, 0) == current_child) {
+      release_replica(current_child);
+    }
+  }
+}
+
+/**
+ * Reaps replicas that exited and frees their slots
+ * Only touches the slot array and atomics, so it is safe in a handler
+ * @param sigNum the received signal, SIGCHLD
+ */
+void reap_replicas (int sigNum) {
+  int saved_errno = errno;
+  (void) sigNum; // Only SIGCHLD is handled here
+  pid_t pid;
+  while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+    release_replica(pid);
+  }
+  errno = saved_errno;
+}
+
+/**
+ * Frees the slot of a replica that was reaped
+ * @param pid the pid of the reaped replica
+ */
+void release_replica (pid_t pid) {
+  int i;
+  for (i = 0; i < MAX_REPLICAS; ++i) {
+    if (child_pids[i].taken && child_pids[i].child_pid == pid) {
+      deallocate_child(&child_pids[i]);
+      if (stats != NULL) {
+        atomic_store(&stats->replicas[i].pid, 0);
+        atomic_fetch_add(&stats->replica_exits, 1);
+      }
+      eventlog_emit(LOG_INFO, EV_REPLICA_EXITED, server_name, pid, i);
+      return;
+    }
+  }
+}
+
 /*
  *Shuts down a server's child process
+ *Its loop wakes on the stop eventfd, and returns at once for SIGUSR1 or
+ *once its jobs are drained for SIGTERM.
  *@param sigNum the signal sent to the child
 */
 void replica_sig_handler (int sigNum) {
-  if (sigNum == SIGUSR1){
-   printf("Child process here, shutting down...\n\n");
-   exit(0);
+  int saved_errno = errno;
+  uint64_t value = sigNum == SIGUSR1 ? STOP_NOW : 1;
+  if (write(my_stop_fd, &value, sizeof(value)) < 0) {
+    _exit(1); // Nothing left to wake the loop, so at least stop
+  }
+  errno = saved_errno;
+}
+
+/**
+ * Asks the newest replica to finish its jobs and exit, when the manager
+ * scales the server down. The last replica serving is never retired.
+ * Runs from the main loop once RETIRE_SIGNAL was received; the slot is
+ * released once the replica is reaped or joined.
+ */
+void retire_replica () {
+  int i, serving = 0, newest = -1;
+  for (i = 0; i < MAX_REPLICAS; ++i) {
+    if (child_pids[i].taken && !child_pids[i].retiring) {
+      serving++;
+      newest = i;
+    }
+  }
+  if (serving < 2) {
+    return;
+  }
+  child_pids[newest].retiring = true;
+  eventlog_emit(LOG_INFO, EV_REPLICA_RETIRING, server_name,
+                child_pids[newest].child_pid, newest);
+  if (options.threads) {
+    uint64_t one = 1;
+    if (write(child_pids[newest].stop_fd, &one, sizeof(one)) < 0) {
+      child_pids[newest].retiring = false;
+    }
+  } else {
+    kill(child_pids[newest].child_pid, SIGTERM);
   }
 }
 
@@ -65,8 +192,8 @@ void replica_sig_handler (int sigNum) {
  * @param child_pids the array of its children's IDs
  */
 void allocate_child( Children * child){
-   child = malloc(sizeof(Children));
    child->taken = true;
+   child->retiring = false;
 }
 
 /**
@@ -78,6 +205,615 @@ void deallocate_child( Children * child){
    child->taken = false;
 }
 
+/**
+ * Parses the key=value options following the limits
+ * Unknown keys are ignored so older servers accept newer managers, but an
+ * unknown value of a known key is an error.
+ * @param argc the number of arguments
+ * @param argv the server's arguments, options start at argv[5]
+ * @param options the options to fill
+ * @return 0 on success, -1 if an option has an invalid value
+ */
+int parse_options ( int argc, char* argv[], ServerOptions* options ){
+  memset(options, 0, sizeof(ServerOptions));
+  options->concurrency = DEFAULT_CONCURRENCY;
+  int i;
+  for ( i = 5; i < argc; ++i){
+    char* value = strchr(argv[i], '=');
+    if ( value == NULL){
+      options->port = atoi(argv[i]);
+      continue;
+    }
+    value++;
+    if ( strncmp(argv[i], "port=", 5) == 0){
+      options->port = atoi(value);
+    } else if ( strncmp(argv[i], "zygote=", 7) == 0){
+      options->zygote = atoi(value) != 0;
+    } else if ( strncmp(argv[i], "config=", 7) == 0){
+      options->config = value;
+    } else if ( strncmp(argv[i], "mode=", 5) == 0){
+      if ( strcmp(value, "thread") != 0 && strcmp(value, "process") != 0){
+        fprintf(stderr, "[Server: %s]: Unknown mode %s\n", argv[2], value);
+        return -1;
+      }
+      options->threads = strcmp(value, "thread") == 0;
+    } else if ( strncmp(argv[i], "concurrency=", 12) == 0){
+      options->concurrency = atoi(value);
+    } else if ( strncmp(argv[i], "queue=", 6) == 0){
+      options->queue_limit = atoi(value);
+    } else if ( strncmp(argv[i], "queue_timeout=", 14) == 0){
+      options->queue_timeout = atoi(value);
+    } else if ( strncmp(argv[i], "qos=", 4) == 0){
+      int qos = qos_parse(value);
+      if ( qos < 0){
+        fprintf(stderr, "[Server: %s]: Unknown qos class %s\n", argv[2], value);
+        return -1;
+      }
+      options->qos = qos;
+      options->qos_set = true;
+    } else if ( strncmp(argv[i], "cpus=", 5) == 0){
+      if ( qos_check_cpus(value) < 0){
+        fprintf(stderr, "[Server: %s]: Invalid CPU list %s\n", argv[2], value);
+        return -1;
+      }
+      options->cpus = value;
+      options->qos_set = true;
+    } else if ( strncmp(argv[i], "overload=", 9) == 0){
+      if ( strcmp(value, "queue") == 0){
+        options->overload = OVERLOAD_QUEUE;
+      } else if ( strcmp(value, "shed") == 0){
+        options->overload = OVERLOAD_SHED;
+      } else if ( strcmp(value, "reject") == 0){
+        options->overload = OVERLOAD_REJECT;
+      } else {
+        fprintf(stderr, "[Server: %s]: Unknown overload policy %s\n", argv[2],
+                value);
+        return -1;
+      }
+    }
+  }
+  if ( options->queue_limit < 0){
+    options->queue_limit = 0;
+  } else if ( options->queue_limit > MAX_QUEUE){
+    options->queue_limit = MAX_QUEUE;
+  }
+  if ( options->concurrency < 1){
+    options->concurrency = 1;
+  } else if ( options->concurrency > MAX_CONCURRENCY){
+    options->concurrency = MAX_CONCURRENCY;
+  }
+  return 0;
+}
+
+/**
+ * Binds a TCP listening socket on the given port
+ * @param port the port to listen on
+ * @return the listening descriptor, -1 on error
+ */
+int open_listener ( int port ){
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if ( fd < 0){
+    return -1;
+  }
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if ( bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+       listen(fd, LISTEN_BACKLOG) < 0){
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Sets up the server's listening sockets.
+ * When started by the manager, the listeners of a previous instance arrive
+ * over the control socket and are reused as is, so connections queued in
+ * their backlog survive the restart. Otherwise we bind the given port.
+ * The final set is sent back so the manager can hand it to our successor.
+ * @param control_fd the server's end of the control socket, -1 if none
+ * @param port the port to bind when nothing was inherited, 0 for none
+ * @return 0 on success, -1 on error
+ */
+int setup_listeners ( int control_fd, int port ){
+  if ( control_fd >= 0){
+    num_listen_fds = recv_fds(control_fd, listen_fds, MAX_PASSED_FDS);
+    if ( num_listen_fds < 0){
+      num_listen_fds = 0;
+      return -1;
+    }
+  }
+  if ( num_listen_fds == 0 && port > 0){
+    int fd = open_listener(port);
+    if ( fd < 0){
+      perror("open_listener");
+    } else {
+      listen_fds[num_listen_fds++] = fd;
+    }
+  }
+
+  // Replicas race to accept, the losers must not block on an empty queue
+  int i;
+  for ( i = 0; i < num_listen_fds; ++i){
+    fcntl(listen_fds[i], F_SETFL, fcntl(listen_fds[i], F_GETFL) | O_NONBLOCK);
+  }
+  if ( control_fd >= 0){
+    return send_fds(control_fd, listen_fds, num_listen_fds);
+  }
+  return 0;
+}
+
+/**
+ * Handles a single job on an accepted connection.
+ * "GET key" is answered from the preloaded configuration, any other
+ * request is echoed back. The connection is non-blocking, the job
+ * yields to the replica's other jobs whenever it would block.
+ * @param conn the accepted connection
+ */
+void handle_job ( int conn ){
+  char buffer[JOB_BUFFER_SIZE];
+  ssize_t n = co_read(conn, buffer, sizeof(buffer) - 1);
+  if ( n <= 0){
+    return;
+  }
+  if ( n > 4 && strncmp(buffer, "GET ", 4) == 0){
+    buffer[n] = '\0';
+    buffer[strcspn(buffer, "\r\n")] = '\0';
+    const char* value = preload_lookup(&preloaded, buffer + 4);
+    char reply[JOB_BUFFER_SIZE];
+    int len = snprintf(reply, sizeof(reply), "%s\n",
+                       value != NULL ? value : "NOTFOUND");
+    co_write(conn, reply, len < (int) sizeof(reply) ? (size_t) len
+                                                    : sizeof(reply) - 1);
+  } else {
+    co_write(conn, buffer, n);
+  }
+}
+
+/**
+ * Reads the monotonic clock
+ * @return the time in nanoseconds
+ */
+uint64_t monotonic_ns (){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Runs one accepted connection as a coroutine of the replica
+ * and records its latency, from accept to close, queueing included
+ * @param arg the Job, copied before the coroutine first yields
+ */
+void run_job ( void* arg ){
+  Job job = *(Job*) arg;
+  ReplicaStats* replica = stats != NULL ? &stats->replicas[my_slot] : NULL;
+  if ( replica != NULL){
+    uint32_t in_flight = atomic_fetch_add(&replica->in_flight, 1) + 1;
+    if ( in_flight > atomic_load(&replica->peak_in_flight)){
+      atomic_store(&replica->peak_in_flight, in_flight);
+    }
+  }
+  handle_job(job.conn);
+  close(job.conn);
+  if ( replica != NULL){
+    hist_record(&replica->latency, monotonic_ns() - job.accepted);
+    atomic_fetch_sub(&replica->in_flight, 1);
+  }
+}
+
+/**
+ * Turns a job away with a BUSY reply, so the client can back off or try
+ * again elsewhere instead of waiting on an overloaded replica
+ * @param conn the accepted connection
+ */
+void turn_away ( int conn ){
+  send(conn, BUSY_REPLY, sizeof(BUSY_REPLY) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+  close(conn);
+}
+
+/**
+ * Starts a job on a coroutine, dropping it if none can be had
+ */
+static void start_job ( Scheduler* sched, Job* job ){
+  if ( co_spawn(sched, run_job, job) < 0){
+    close(job->conn);
+  }
+}
+
+/**
+ * Starts a job right away, queues it, or applies the overload policy
+ * With a full queue, shed drops the oldest queued job in favour of the
+ * new one, since its client has waited longest and may have given up.
+ * The others turn the new job away, queue only gets here when several
+ * listeners accepted at once.
+ * @param sched the replica's scheduler
+ * @param queue the replica's queue
+ * @param conn the accepted connection
+ */
+void admit_job ( Scheduler* sched, JobQueue* queue, int conn ){
+  ReplicaStats* replica = stats != NULL ? &stats->replicas[my_slot] : NULL;
+  Job job = { conn, monotonic_ns() };
+  if ( sched->active < sched->cap && queue->count == 0){
+    start_job(sched, &job);
+    return;
+  }
+  if ( queue->count == queue->capacity){
+    if ( options.overload != OVERLOAD_SHED || queue->capacity == 0){
+      turn_away(conn);
+      if ( replica != NULL){
+        atomic_fetch_add(&replica->rejected, 1);
+      }
+      return;
+    }
+    turn_away(queue->jobs[queue->head].conn);
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    if ( replica != NULL){
+      atomic_fetch_add(&replica->shed, 1);
+    }
+  }
+  queue->jobs[(queue->head + queue->count++) % queue->capacity] = job;
+}
+
+/**
+ * Starts queued jobs while there are free coroutines
+ * Jobs that waited longer than queue_timeout are shed instead, serving
+ * them late would only delay the ones behind them.
+ * @param sched the replica's scheduler
+ * @param queue the replica's queue
+ */
+void start_queued_jobs ( Scheduler* sched, JobQueue* queue ){
+  ReplicaStats* replica = stats != NULL ? &stats->replicas[my_slot] : NULL;
+  uint64_t timeout = options.queue_timeout * 1000000ULL;
+  uint64_t now = monotonic_ns();
+  while ( sched->active < sched->cap && queue->count > 0){
+    Job job = queue->jobs[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    if ( timeout > 0 && now - job.accepted > timeout){
+      turn_away(job.conn);
+      if ( replica != NULL){
+        atomic_fetch_add(&replica->shed, 1);
+      }
+      continue;
+    }
+    start_job(sched, &job);
+  }
+  if ( replica != NULL){
+    atomic_store(&replica->queued, queue->count);
+  }
+}
+
+/**
+ * Records whether the replica is overloaded and tells the manager
+ * The notice is best effort, a full control socket only means the
+ * manager learns of it from the statistics on its next look.
+ * @param overloaded whether the replica's queue is full
+ */
+void set_overloaded ( bool overloaded ){
+  if ( stats == NULL ||
+       atomic_load(&stats->replicas[my_slot].overloaded) == overloaded){
+    return;
+  }
+  atomic_store(&stats->replicas[my_slot].overloaded, overloaded);
+  if ( control_sock >= 0){
+    LoadNotice notice = { my_slot, overloaded };
+    send(control_sock, &notice, sizeof(notice), MSG_DONTWAIT | MSG_NOSIGNAL);
+  }
+}
+
+/**
+ * Releases what a replica's loop holds once it stops serving
+ * Connections accepted but not handed to a job yet, queued or completed
+ * and not collected, are turned away since the replica's descriptors
+ * outlive it in thread mode. Coroutines still suspended are dropped.
+ * @param loop the replica's I/O loop
+ * @param sched the replica's scheduler
+ * @param queue the replica's queue
+ * @param done completed operations collected but not handled yet
+ * @param n the number of them
+ * @param accepts_in_flight the accepts still submitted
+ * @param backoff_fd the timer pausing accepts after errors
+ */
+static void close_replica ( IoLoop* loop, Scheduler* sched, JobQueue* queue,
+                            IoOp** done, int n, int accepts_in_flight,
+                            int backoff_fd ){
+  IoOp* more[IO_BATCH];
+  int i;
+  while ( queue->count > 0){
+    turn_away(queue->jobs[queue->head].conn);
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+  }
+  for ( i = 0; i < n; ++i){
+    if ( done[i]->kind != IO_ACCEPT){
+      continue;
+    }
+    if ( done[i]->result >= 0){
+      turn_away(done[i]->result);
+    }
+    accepts_in_flight--;
+  }
+  n = accepts_in_flight > 0 ? ioloop_wait(loop, more, IO_BATCH, false) : 0;
+  for ( i = 0; i < n; ++i){
+    if ( more[i]->kind == IO_ACCEPT && more[i]->result >= 0){
+      turn_away(more[i]->result);
+    }
+  }
+  ioloop_close(loop);
+  close(backoff_fd);
+  sched_destroy(sched);
+  free(queue->jobs);
+}
+
+/**
+ * Tells whether a failed accept may be submitted again right away
+ * Other errors, such as running out of descriptors, last a while or for
+ * good, and accepting again at once would only spin on them.
+ * @param error the negated errno the accept completed with
+ */
+static bool accept_retryable ( int error ){
+  return error == -EAGAIN || error == -EWOULDBLOCK || error == -EINTR ||
+         error == -ECONNABORTED;
+}
+
+/**
+ * Main loop of a replica: accepts jobs on the shared listeners,
+ * or waits for signals when the server has nothing to listen on.
+ * Every job runs as a coroutine, up to options.concurrency at once,
+ * and up to options.queue_limit more wait in the replica's queue.
+ * Accepts and the jobs' reads and writes all go through one I/O loop,
+ * which hands them to the kernel in a single call per iteration.
+ * Once asked to retire the replica stops accepting and returns when its
+ * jobs are done. It learns of it through its stop eventfd, which may also
+ * ask it to return at once.
+ */
+void serve_replica (){
+  IoLoop loop;
+  Scheduler sched;
+  JobQueue queue = { calloc(options.queue_limit + 1, sizeof(Job)),
+                     options.queue_limit, 0, 0 };
+  IoOp accepts[MAX_PASSED_FDS], stop, backoff, *done[IO_BATCH];
+  bool accepting[MAX_PASSED_FDS] = { false };
+  bool draining = false, backing_off = false;
+  int i, n, accepts_in_flight = 0;
+  int backoff_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  // One entry per listener, the stop and backoff polls and every job
+  if ( queue.jobs == NULL || backoff_fd < 0 ||
+       ioloop_init(&loop, MAX_PASSED_FDS + 2 + options.concurrency) < 0 ||
+       sched_init(&sched, options.concurrency, &loop) < 0){
+    fprintf(stderr, "[Server: %s]: Could not start the job scheduler\n",
+            server_name);
+    exit(1);
+  }
+  for ( i = 0; i < num_listen_fds; ++i){
+    accepts[i] = (IoOp) { .kind = IO_ACCEPT, .fd = listen_fds[i],
+                          .flags = SOCK_NONBLOCK | SOCK_CLOEXEC };
+  }
+  if ( my_stop_fd >= 0){
+    stop = (IoOp) { .kind = IO_POLL, .fd = my_stop_fd, .flags = POLLIN };
+    ioloop_submit(&loop, &stop);
+  }
+  backoff = (IoOp) { .kind = IO_POLL, .fd = backoff_fd, .flags = POLLIN };
+
+  while(true) {
+    if ( draining && sched.active == 0 && queue.count == 0){
+      break;
+    }
+
+    // Keep one accept per listener in flight. Under the queue policy
+    // only while there is room for its job, so once full, connections
+    // wait in the backlog where other replicas can take them. The other
+    // policies keep accepting to answer the excess right away.
+    int room = sched.cap + queue.capacity - sched.active - queue.count
+               - accepts_in_flight;
+    for ( i = 0; i < num_listen_fds && !draining && !backing_off; ++i){
+      if ( accepting[i] || (options.overload == OVERLOAD_QUEUE && room <= 0)){
+        continue;
+      }
+      if ( ioloop_submit(&loop, &accepts[i]) == 0){
+        accepting[i] = true;
+        accepts_in_flight++;
+        room--;
+      }
+    }
+
+    n = ioloop_wait(&loop, done, IO_BATCH, true);
+    for ( i = 0; i < n; ++i){
+      IoOp* op = done[i];
+      if ( op == &stop){
+        uint64_t value = 0;
+        if ( read(my_stop_fd, &value, sizeof(value)) < 0 || value >= STOP_NOW){
+          // Jobs still in flight are dropped with the server
+          close_replica(&loop, &sched, &queue, &done[i + 1], n - i - 1,
+                        accepts_in_flight, backoff_fd);
+          return;
+        }
+        draining = true; // Still watched, the server may stop us meanwhile
+        ioloop_submit(&loop, &stop);
+        continue;
+      }
+      if ( op == &backoff){
+        uint64_t expirations;
+        read(backoff_fd, &expirations, sizeof(expirations)); // Drains it
+        backing_off = false;
+        continue;
+      }
+      if ( sched_complete(&sched, op)){
+        continue;
+      }
+      // A finished accept, -EAGAIN when another replica won the race
+      int conn = op->result;
+      accepting[op - accepts] = false;
+      accepts_in_flight--;
+      if ( conn >= 0){
+        admit_job(&sched, &queue, conn);
+      } else if ( !accept_retryable(conn) && !backing_off){
+        eventlog_emit(LOG_WARN, EV_ACCEPT_FAILED, server_name, op - accepts,
+                      -conn);
+        struct itimerspec pause = {
+          .it_value = { .tv_sec = ACCEPT_BACKOFF_MS / 1000,
+                        .tv_nsec = (ACCEPT_BACKOFF_MS % 1000) * 1000000L }
+        };
+        backing_off = timerfd_settime(backoff_fd, 0, &pause, NULL) == 0 &&
+                      ioloop_submit(&loop, &backoff) == 0;
+      }
+    }
+    start_queued_jobs(&sched, &queue);
+
+    // Overloaded once the queue is full, and until it is half drained
+    if ( sched.active == sched.cap && queue.count == queue.capacity){
+      set_overloaded(true);
+    } else if ( queue.count <= queue.capacity / 2 && sched.active < sched.cap){
+      set_overloaded(false);
+    }
+    if ( !options.threads){ // The server's main loop flushes for threads
+      eventlog_flush();
+    }
+  }
+  set_overloaded(false);
+  close_replica(&loop, &sched, &queue, NULL, 0, accepts_in_flight,
+                backoff_fd);
+}
+
+/**
+ * Publishes a replica that just started in the given slot
+ * @param slot the slot the replica took
+ * @param pid the replica's pid, or its thread id in thread mode
+ */
+void claim_slot ( int slot, pid_t pid ){
+  if ( stats != NULL){
+    atomic_store(&stats->replicas[slot].pid, pid);
+    atomic_fetch_add(&stats->replica_spawns, 1);
+    if ( atomic_load(&stats->slots_used) < (uint32_t) slot + 1){
+      atomic_store(&stats->slots_used, slot + 1);
+    }
+  }
+  eventlog_emit(LOG_INFO, EV_REPLICA_SPAWNED, server_name, pid, slot);
+}
+
+// Handed to a starting replica thread, which posts its id back
+typedef struct ThreadStart {
+  int slot;
+  int stop_fd;
+  pid_t tid;
+  sem_t ready;
+} ThreadStart;
+
+/**
+ * Entry point of a thread-mode replica
+ * @param arg the ThreadStart of the spawning thread
+ * Once retired it flags its slot and raises SIGCHLD, so the server's main
+ * loop joins it like it would reap a process replica.
+ * @return NULL once stopped or retired
+ */
+void* replica_thread ( void* arg ){
+  ThreadStart* start = arg;
+  int slot = my_slot = start->slot;
+  my_stop_fd = start->stop_fd;
+  start->tid = gettid();
+  sem_post(&start->ready); // start lives on the spawner's stack, done with it
+  serve_replica();
+  if ( child_pids[slot].retiring){
+    eventlog_emit(LOG_INFO, EV_REPLICA_SHUTDOWN, server_name, 0, 0);
+    atomic_store(&child_pids[slot].finished, true);
+    kill(getpid(), SIGCHLD);
+  }
+  return NULL;
+}
+
+/**
+ * Starts a thread-mode replica in the given slot
+ * Threads share the server's listeners, preloaded state and statistics,
+ * so a replica costs little more than its stack.
+ * @param slot a free slot of child_pids
+ * @return 0 on success, -1 on error
+ */
+int start_replica_thread ( int slot ){
+  int stop_fd = eventfd(0, EFD_CLOEXEC);
+  if ( stop_fd < 0){
+    eventlog_emit(LOG_ERROR, EV_REPLICA_SPAWN_FAILED, server_name, slot, errno);
+    return -1;
+  }
+
+  // Replicas block every signal, so the handlers only run on our thread
+  sigset_t all, previous;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &previous);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+  ThreadStart start = { .slot = slot, .stop_fd = stop_fd };
+  sem_init(&start.ready, 0, 0);
+  int error = pthread_create(&child_pids[slot].thread, &attr, replica_thread,
+                             &start);
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+  if ( error != 0){
+    sem_destroy(&start.ready);
+    close(stop_fd);
+    eventlog_emit(LOG_ERROR, EV_REPLICA_SPAWN_FAILED, server_name, slot, error);
+    return -1;
+  }
+  while ( sem_wait(&start.ready) < 0 && errno == EINTR);
+  sem_destroy(&start.ready);
+
+  allocate_child(&child_pids[slot]);
+  child_pids[slot].child_pid = start.tid;
+  child_pids[slot].stop_fd = stop_fd;
+  atomic_store(&child_pids[slot].finished, false);
+  claim_slot(slot, start.tid);
+  return 0;
+}
+
+/**
+ * Joins a replica thread that returned and frees its slot
+ */
+static void join_replica_thread ( int slot ){
+  pthread_join(child_pids[slot].thread, NULL);
+  close(child_pids[slot].stop_fd);
+  release_replica(child_pids[slot].child_pid);
+}
+
+/**
+ * Stops and joins every thread-mode replica
+ * Jobs in flight are dropped, the server exits right after.
+ */
+void stop_replica_threads (){
+  uint64_t now = STOP_NOW;
+  int i;
+  for ( i = 0; i < MAX_REPLICAS; ++i){
+    if ( child_pids[i].taken && write(child_pids[i].stop_fd, &now,
+                                      sizeof(now)) < 0){
+      perror("stop_replica_threads");
+    }
+  }
+  for ( i = 0; i < MAX_REPLICAS; ++i){
+    if ( child_pids[i].taken){
+      join_replica_thread(i);
+    }
+  }
+}
+
+/**
+ * Joins the thread-mode replicas that finished retiring
+ */
+void join_finished_threads (){
+  int i;
+  for ( i = 0; i < MAX_REPLICAS; ++i){
+    if ( child_pids[i].taken && atomic_load(&child_pids[i].finished)){
+      join_replica_thread(i);
+    }
+  }
+}
+
 /**
  * Replicates the server a given number of times 
  * @param child_pids the array of its children's pids
@@ -87,32 +823,77 @@ void deallocate_child( Children * child){
 int replicate ( int num, pid_t* parent_pid, Children child_pids[]) {
   
   // Loop through the children and create a replica as necessary 
-  int child;
-  for (child = 0; child < num; ++child){
+  int child, created;
+  for (created = 0; created < num; ++created){
     
-    pid_t pid, temp_pid1, temp_pid = getpid();
-    if ( temp_pid == *parent_pid) { // Only the parent is allowed to fork
-      pid = fork();
-      temp_pid1 = pid;
-      if ( pid < 0){
-        fprintf(stderr, "Forking child #%d failed!!\n", child);
+    // Reuse the first free slot so replicas added later do not clobber others
+    for (child = 0; child < MAX_REPLICAS && child_pids[child].taken; ++child);
+    if ( child == MAX_REPLICAS){
+      eventlog_emit(LOG_WARN, EV_REPLICA_SPAWN_FAILED, server_name, -1, 0);
+      return -1;
+    }
+    if ( stats != NULL){ // Reset before the replica can start counting
+      atomic_store(&stats->replicas[child].in_flight, 0);
+      atomic_store(&stats->replicas[child].peak_in_flight, 0);
+      atomic_store(&stats->replicas[child].queued, 0);
+      atomic_store(&stats->replicas[child].overloaded, false);
+    }
+    if ( options.threads){
+      if ( start_replica_thread(child) < 0){
         return -1;
       }
-    } 
+      continue;
+    }
+
+    if ( getpid() != *parent_pid) { // Only the parent is allowed to fork
+      return -1;
+    }
+    pid_t pid = fork();
+    if ( pid < 0){
+      eventlog_emit(LOG_ERROR, EV_REPLICA_SPAWN_FAILED, server_name, child,
+                    errno);
+      return -1;
+    }
     if ( pid != 0 ) { // The parent updates this child's struct
       allocate_child(&child_pids[child]);
-      child_pids[child].child_pid = temp_pid1;
+      child_pids[child].child_pid = pid;
+      claim_slot(child, pid);
     }
     if ( pid == 0 ) {
+      my_slot = child;
+      eventlog_after_fork("replica");
+      pending_replicas = pending_retires = shutdown_requested = 0;
+      my_stop_fd = eventfd(0, EFD_CLOEXEC);
+      if ( my_stop_fd < 0){
+        eventlog_emit(LOG_ERROR, EV_REPLICA_SPAWN_FAILED, server_name, child,
+                      errno);
+        eventlog_flush();
+        exit(1);
+      }
+      signal(SIGCHLD, SIG_DFL);
+      signal(RETIRE_SIGNAL, SIG_IGN);
+      signal(SIGUSR2, SIG_IGN);
       // Register kill signal from parent server
       signal(SIGUSR1, replica_sig_handler);
+      signal(SIGTERM, replica_sig_handler);
+      // Forked from the main loop we inherit its mask, which blocks the
+      // very SIGUSR1 the server sends to shut us down
+      sigset_t none;
+      sigemptyset(&none);
+      sigprocmask(SIG_SETMASK, &none, NULL);
+      // Follow the server down if it crashes, its respawn replaces us
+      prctl(PR_SET_PDEATHSIG, SIGUSR1);
+
+      // Without a zygote every replica starts cold and loads its own copy
+      if ( !preloaded.loaded){
+        preload_state(&preloaded, options.config);
+      }
       
-      int my_pid = getpid();
-      printf("[Replica]: Spawned child with pid %d and whose parent is %d\n\n", 
-	   my_pid, *parent_pid);
-      
-      // Execute infitely
-      while(true);
+      // Execute until retired, then leave rather than replicate further
+      serve_replica();
+      eventlog_emit(LOG_INFO, EV_REPLICA_SHUTDOWN, server_name, 0, 0);
+      eventlog_flush();
+      exit(0);
     }
       
   }
@@ -121,26 +902,99 @@ int replicate ( int num, pid_t* parent_pid, Children child_pids[]) {
 
 int main(int argc, char* argv[]){
   
+  eventlog_init("server");
+
   // Register the CTRL-C signal from the manager
   signal(SIGUSR1, server_sig_handler);
   signal(SIGUSR2, server_sig_handler);  
+  signal(RETIRE_SIGNAL, server_sig_handler);
+  signal(SIGCHLD, reap_replicas);
 
-  printf("[Server: %s]: I am a new server, spawning %d "
-          "children to begin\n\n", argv[1], atoi(argv[3]));
-  
   // Global variables for the children pids and arguments passed in
-  char* my_sname = argv[1];
+  char* my_sname = argv[2];
+  server_name = my_sname;
   int fork_success, num_active = atoi(argv[3]);
   pid_t parent_pid = getpid();
+
+  // Inherit listeners from the manager or bind our own before replicating
+  char* control_env = getenv(CONTROL_FD_ENV);
+  int control_fd = control_env != NULL ? atoi(control_env) : -1;
+  control_sock = control_fd;
+  if ( parse_options(argc, argv, &options) < 0){
+    exit(1); // Never run other than as asked
+  }
+
+  // Replicas and replica threads inherit the class from us
+  if ( options.qos_set && qos_apply(options.qos, options.cpus) < 0){
+    fprintf(stderr, "[Server: %s]: Could not fully apply qos=%s\n", my_sname,
+            qos_name(options.qos));
+  }
+  if ( setup_listeners(control_fd, options.port) < 0){
+    fprintf(stderr, "[Server: %s]: Could not set up listeners\n", my_sname);
+  }
+
+  // Map the statistics before replicating so every replica shares them
+  int stats_fd = -1;
+  stats = stats_create(&stats_fd);
+  if ( control_fd >= 0 && send_fds(control_fd, &stats_fd, stats != NULL) < 0){
+    fprintf(stderr, "[Server: %s]: Could not share statistics\n", my_sname);
+  }
 	
+  // As a zygote, load everything once so replicas share it copy-on-write.
+  // Thread-mode replicas share our memory outright, so always load it here.
+  if ( stats != NULL){
+    atomic_store(&stats->thread_mode, options.threads);
+    atomic_store(&stats->concurrency, options.concurrency);
+    atomic_store(&stats->queue_limit, options.queue_limit);
+  }
+  if ( options.zygote || options.threads){
+    if ( preload_state(&preloaded, options.config) < 0){
+      fprintf(stderr, "[Server: %s]: Could not load %s\n", my_sname,
+              options.config);
+    }
+    eventlog_emit(LOG_INFO, EV_SERVER_PRELOADED, server_name,
+                  preloaded.entries, preloaded.code_bytes);
+  }
+
   // Fork the children num_active number of times
+  eventlog_emit(LOG_INFO, EV_SERVER_STARTED, server_name, num_active,
+                num_listen_fds);
   fork_success = replicate(num_active, &parent_pid, child_pids);
   if ( (fork_success) < 0){
     fprintf(stderr, "There was an error replicating child "
                "processes in the %s server\n", my_sname);
   }
   
-  
-  pause();
+  // The handlers only record what they were asked, it is carried out here
+  // in order: new replicas before retirements, as the manager sends them.
+  // Signals stay blocked outside sigsuspend so none slips in unseen.
+  sigset_t block, previous;
+  sigemptyset(&block);
+  sigaddset(&block, SIGUSR1);
+  sigaddset(&block, SIGUSR2);
+  sigaddset(&block, SIGCHLD);
+  sigaddset(&block, RETIRE_SIGNAL);
+  sigprocmask(SIG_BLOCK, &block, &previous);
+  while (true) {
+    if ( shutdown_requested){
+      eventlog_emit(LOG_INFO, EV_SERVER_SHUTDOWN, server_name, 0, 0);
+      if ( options.threads){
+        stop_replica_threads();
+      } else {
+        stop_replica_processes();
+      }
+      eventlog_flush();
+      exit(1);
+    }
+    for ( ; pending_replicas > 0; pending_replicas--){
+      replicate(ONCE, &parent_pid, child_pids);
+    }
+    for ( ; pending_retires > 0; pending_retires--){
+      retire_replica();
+    }
+    join_finished_threads();
+    eventlog_flush();
+    sigsuspend(&previous);
+  }
   return 0;
 }
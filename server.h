@@ -4,6 +4,22 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include "stats.h"
+#include "coroutine.h"
+#include "qos.h"
+
+// Jobs a replica multiplexes at once unless concurrency=N says otherwise
+#define DEFAULT_CONCURRENCY 64
+#define MAX_CONCURRENCY 4096
+#define MAX_QUEUE 4096
+
+// What a replica does with new jobs once its queue is full
+typedef enum OverloadPolicy {
+  OVERLOAD_QUEUE,                      // Stop accepting, the backlog holds them
+  OVERLOAD_SHED,                       // Drop the oldest queued job for it
+  OVERLOAD_REJECT                      // Answer BUSY right away
+} OverloadPolicy;
 
 
 /***********************************************
@@ -14,10 +30,44 @@
 
 typedef bool available;
 
+// Options the manager passes after the limits, as key=value arguments.
+// A bare number is the port, as accepted before options existed.
+typedef struct ServerOptions {
+  int port;                            // port=N, 0 when not listening
+  bool zygote;                         // zygote=1 preloads before replicating
+  const char* config;                  // config=path of "key value" lines
+  bool threads;                        // mode=thread runs replicas as threads
+  int concurrency;                     // concurrency=N jobs per replica
+  int queue_limit;                     // queue=N jobs waiting per replica
+  OverloadPolicy overload;             // overload=queue|shed|reject
+  int queue_timeout;                   // queue_timeout=ms, 0 waits forever
+  QosClass qos;                        // qos=critical|standard|batch|idle
+  const char* cpus;                    // cpus=0,2-3 pins the replicas
+  bool qos_set;                        // Either was given, apply them
+} ServerOptions;
+
+// An accepted connection and when it was accepted
+typedef struct Job {
+  int conn;
+  uint64_t accepted;                   // CLOCK_MONOTONIC nanoseconds
+} Job;
+
+// Jobs a replica accepted but has no coroutine for yet, oldest first
+typedef struct JobQueue {
+  Job* jobs;
+  int capacity;
+  int head;
+  int count;
+} JobQueue;
+
 // The structure to keep track of a server's children
 typedef struct Children {
     available taken;
     pid_t child_pid;
+    bool retiring;                     // Asked to finish its jobs and exit
+    pthread_t thread;                  // Set for thread-mode replicas only
+    int stop_fd;                       // eventfd a replica thread watches
+    _Atomic bool finished;             // The thread returned, join it
 } Children;
 
 /**
@@ -37,6 +87,17 @@ void deallocate_child( Children * child);
  */
 void server_sig_handler (int sigNum);
 
+/**
+ * Reaps replicas that exited and frees their slots
+ * @param sigNum the received signal, SIGCHLD
+ */
+void reap_replicas (int sigNum);
+
+/**
+ * Frees the slot of a replica that was reaped
+ */
+void release_replica (pid_t pid);
+
 /*
  *Shuts down a server's child process
   @param sigNum the signal sent to the child
@@ -44,6 +105,98 @@ void server_sig_handler (int sigNum);
 void replica_sig_handler (int sigNum);
 
 
+/**
+ * Parses the key=value options following the limits
+ * @return 0 on success, -1 if an option has an invalid value
+ */
+int parse_options ( int argc, char* argv[], ServerOptions* options );
+
+/**
+ * Binds a TCP listening socket on the given port
+ */
+int open_listener ( int port );
+
+/**
+ * Inherits listeners over the control socket or binds the given port,
+ * then reports the final set back to the manager
+ */
+int setup_listeners ( int control_fd, int port );
+
+/**
+ * Handles a single job on an accepted connection
+ */
+void handle_job ( int conn );
+
+/**
+ * Reads the monotonic clock in nanoseconds
+ */
+uint64_t monotonic_ns ();
+
+/**
+ * Runs one accepted connection as a coroutine of the replica
+ */
+void run_job ( void* arg );
+
+/**
+ * Turns a job away with a BUSY reply
+ */
+void turn_away ( int conn );
+
+/**
+ * Starts a job right away, queues it, or applies the overload policy
+ */
+void admit_job ( Scheduler* sched, JobQueue* queue, int conn );
+
+/**
+ * Starts queued jobs while there are free coroutines
+ */
+void start_queued_jobs ( Scheduler* sched, JobQueue* queue );
+
+/**
+ * Records whether the replica is overloaded and tells the manager
+ */
+void set_overloaded ( bool overloaded );
+
+/**
+ * Main loop of a replica
+ */
+void serve_replica ();
+
+/**
+ * Publishes a replica that just started in the given slot
+ */
+void claim_slot ( int slot, pid_t pid );
+
+/**
+ * Starts a thread-mode replica in the given slot
+ */
+int start_replica_thread ( int slot );
+
+/**
+ * Entry point of a thread-mode replica
+ */
+void* replica_thread ( void* arg );
+
+/**
+ * Stops and joins every thread-mode replica
+ */
+void stop_replica_threads ();
+
+/**
+ * Stops every process replica and waits for it, before the server exits
+ */
+void stop_replica_processes ();
+
+/**
+ * Joins the thread-mode replicas that finished retiring
+ */
+void join_finished_threads ();
+
+/**
+ * Asks the newest replica to finish its jobs and exit
+ */
+void retire_replica ();
+
 /**
  * Replicates the server a given number of times 
  */
@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include "spawner.h"
+#include "fdpass.h"
+#include "ioloop.h"
+
+/*****************************************************
+* Spawner helper: starts servers for the manager
+* Messages travel over a SOCK_SEQPACKET socket so each
+* one is read whole, a request carrying the server's end
+* of its control socket along with it.
+* Author: Gloire Rubambiza
+* Version: 10/25/2017
+******************************************************/
+
+#define ENV_BUFFER_SIZE 32
+
+extern char** environ;
+
+/**
+ * Starts one server with posix_spawn
+ * The control socket is moved to SPAWN_CONTROL_FD and advertised in the
+ * environment, and the server starts with no signal blocked.
+ * @return the pid of the server, -1 with errno set on error
+ */
+static pid_t spawn_server ( SpawnMessage* request, int control_fd ){
+  char* argv[SPAWN_MAX_ARGS + 1];
+  char* arg = request->args;
+  uint32_t i;
+  for ( i = 0; i < request->argc && i < SPAWN_MAX_ARGS; ++i){
+    argv[i] = arg;
+    arg += strlen(arg) + 1;
+  }
+  argv[i] = NULL;
+
+  // The environment of the helper, with the control descriptor replaced
+  int count = 0, k = 0;
+  while ( environ[count] != NULL){
+    count++;
+  }
+  char** envp = malloc(sizeof(char*) * (count + 2));
+  char control_env[ENV_BUFFER_SIZE];
+  snprintf(control_env, sizeof(control_env), "%s=%d", CONTROL_FD_ENV,
+           SPAWN_CONTROL_FD);
+  for ( i = 0; (int) i < count; ++i){
+    if ( strncmp(environ[i], CONTROL_FD_ENV "=", strlen(CONTROL_FD_ENV) + 1) != 0){
+      envp[k++] = environ[i];
+    }
+  }
+  envp[k++] = control_env;
+  envp[k] = NULL;
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, control_fd, SPAWN_CONTROL_FD);
+
+  posix_spawnattr_t attr;
+  sigset_t none, all;
+  sigemptyset(&none);
+  sigfillset(&all);
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setsigmask(&attr, &none);
+  posix_spawnattr_setsigdefault(&attr, &all);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+  pid_t pid;
+  int error = posix_spawnp(&pid, argv[0], &actions, &attr, argv, envp);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  free(envp);
+  if ( error != 0){
+    errno = error;
+    return -1;
+  }
+  return pid;
+}
+
+/**
+ * Main loop of the helper, it exits once the manager is gone
+ * @param sock the helper's end of the socket
+ * @param watch reaps the servers it started
+ */
+static void spawner_main ( int sock, ChildWatch* watch ){
+  struct pollfd pfds[2] = {
+    { .fd = sock, .events = POLLIN },
+    { .fd = child_watch_init(watch), .events = POLLIN }
+  };
+  SpawnMessage msg;
+
+  while (1) {
+    if ( poll(pfds, 2, -1) < 0){
+      continue;
+    }
+
+    if ( pfds[1].revents & POLLIN){
+      int status;
+      pid_t pid;
+      while ( (pid = child_watch_reap(watch, &status)) > 0){
+        memset(&msg, 0, offsetof(SpawnMessage, args));
+        msg.type = SPAWN_EXIT;
+        msg.pid = pid;
+        msg.status = status;
+        send(sock, &msg, offsetof(SpawnMessage, args), MSG_NOSIGNAL);
+      }
+    }
+
+    if ( pfds[0].revents & (POLLIN | POLLHUP)){
+      int fds[1], num_fds;
+      ssize_t got = recv_msg_fds(sock, &msg, sizeof(msg), fds, 1, &num_fds);
+      if ( got <= 0){
+        _exit(0);
+      }
+      if ( msg.type != SPAWN_REQUEST || num_fds != 1){
+        close_fds(fds, &num_fds);
+        continue;
+      }
+      // A control socket already on the target would be closed by dup2
+      if ( fds[0] == SPAWN_CONTROL_FD){
+        fds[0] = fcntl(SPAWN_CONTROL_FD, F_DUPFD_CLOEXEC, SPAWN_CONTROL_FD + 1);
+        close(SPAWN_CONTROL_FD);
+      }
+      pid_t pid = spawn_server(&msg, fds[0]);
+      msg.type = SPAWN_RESULT;
+      msg.pid = pid;
+      msg.status = pid < 0 ? errno : 0;
+      if ( pid > 0){
+        child_watch_rearm(watch);
+      }
+      close_fds(fds, &num_fds);
+      send(sock, &msg, offsetof(SpawnMessage, args), MSG_NOSIGNAL);
+    }
+  }
+}
+
+/**
+ * Forks the spawner helper
+ * Call it before the manager grows, the helper keeps the small footprint
+ * it has at this point for its whole life.
+ * @param sock set to the manager's end of the helper's socket
+ * @return the pid of the helper, -1 on error
+ */
+pid_t start_spawner ( int* sock ){
+  int sv[2];
+  if ( socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0){
+    return -1;
+  }
+
+  // SIGCHLD is blocked around the fork so the helper's watch sees all
+  sigset_t sigchld, previous;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &sigchld, &previous);
+
+  pid_t pid = fork();
+  if ( pid == 0){
+    close(sv[0]);
+    ChildWatch watch;
+    spawner_main(sv[1], &watch);
+  }
+  sigprocmask(SIG_SETMASK, &previous, NULL);
+  close(sv[1]);
+  if ( pid < 0){
+    close(sv[0]);
+    return -1;
+  }
+  *sock = sv[0];
+  return pid;
+}
+
+/**
+ * Asks the helper to start a server
+ * @param sock the manager's end of the helper's socket
+ * @param id identifies the request in the result
+ * @param argv the arguments of the server, NULL terminated
+ * @param control_fd the server's end of its control socket
+ * @return 0 once the request is sent, -1 on error
+ */
+int spawner_request ( int sock, uint32_t id, char* argv[], int control_fd ){
+  SpawnMessage msg;
+  memset(&msg, 0, offsetof(SpawnMessage, args));
+  msg.type = SPAWN_REQUEST;
+  msg.id = id;
+
+  size_t len = 0;
+  for ( msg.argc = 0; argv[msg.argc] != NULL; ++msg.argc){
+    size_t arg_len = strlen(argv[msg.argc]) + 1;
+    if ( msg.argc == SPAWN_MAX_ARGS || len + arg_len > SPAWN_ARGS_SIZE){
+      errno = E2BIG;
+      return -1;
+    }
+    memcpy(msg.args + len, argv[msg.argc], arg_len);
+    len += arg_len;
+  }
+  return send_msg_fds(sock, &msg, offsetof(SpawnMessage, args) + len,
+                      &control_fd, 1);
+}
+
+/**
+ * Receives a result or an exit from the helper
+ * @return 0 on success, -1 if the helper is gone
+ */
+int spawner_receive ( int sock, SpawnMessage* msg ){
+  int fds[1], num_fds;
+  ssize_t got = recv_msg_fds(sock, msg, sizeof(SpawnMessage), fds, 1, &num_fds);
+  close_fds(fds, &num_fds);
+  return got >= (ssize_t) offsetof(SpawnMessage, args) ? 0 : -1;
+}
@@ -0,0 +1,60 @@
+#ifndef H_SPAWNER
+#define H_SPAWNER
+#include <stdint.h>
+#include <sys/types.h>
+
+/***********************************************
+* Spawner helper process of the server manager
+* The manager forks it at startup, while still small, and
+* sends it every server to start. The helper posix_spawns
+* them and reports their pids and exits, so spawn latency
+* does not grow with the manager and never blocks it.
+* Author: Gloire Rubambiza
+* Version: 10/25/2017
+***********************************************/
+
+#define SPAWN_ARGS_SIZE 2048
+#define SPAWN_MAX_ARGS 32
+
+// The control socket of a spawned server is always this descriptor
+#define SPAWN_CONTROL_FD 3
+
+typedef enum SpawnMessageType {
+  SPAWN_REQUEST,                       // Manager to helper, start a server
+  SPAWN_RESULT,                        // Helper to manager, pid or errno
+  SPAWN_EXIT                           // Helper to manager, a server exited
+} SpawnMessageType;
+
+typedef struct SpawnMessage {
+  uint32_t type;
+  uint32_t id;                         // Matches a result to its request
+  pid_t pid;
+  int status;                          // errno of a result, wait status of an exit
+  uint32_t argc;
+  char args[SPAWN_ARGS_SIZE];          // argv, each string NUL terminated
+} SpawnMessage;
+
+/**
+ * Forks the spawner helper
+ * @param sock set to the manager's end of the helper's socket
+ * @return the pid of the helper, -1 on error
+ */
+pid_t start_spawner ( int* sock );
+
+/**
+ * Asks the helper to start a server
+ * @param sock the manager's end of the helper's socket
+ * @param id identifies the request in the result
+ * @param argv the arguments of the server, NULL terminated
+ * @param control_fd the server's end of its control socket
+ * @return 0 once the request is sent, -1 on error
+ */
+int spawner_request ( int sock, uint32_t id, char* argv[], int control_fd );
+
+/**
+ * Receives a result or an exit from the helper
+ * @return 0 on success, -1 if the helper is gone
+ */
+int spawner_receive ( int sock, SpawnMessage* msg );
+
+#endif
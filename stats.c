@@ -0,0 +1,123 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "stats.h"
+
+/*****************************************************
+* Shared memory statistics of a server and its replicas
+* Author: Gloire Rubambiza
+* Version: 10/20/2017
+******************************************************/
+
+/**
+ * Creates the shared statistics of a server
+ * @param fd set to the memfd backing the statistics
+ * @return the mapped statistics, NULL on error
+ */
+ServerStats* stats_create ( int* fd ){
+  *fd = memfd_create("scs-stats", MFD_CLOEXEC);
+  if ( *fd < 0){
+    return NULL;
+  }
+  if ( ftruncate(*fd, sizeof(ServerStats)) < 0){
+    close(*fd);
+    *fd = -1;
+    return NULL;
+  }
+  // A fresh memfd reads as zeros, so every slot starts free and empty
+  ServerStats* stats = mmap(NULL, sizeof(ServerStats), PROT_READ | PROT_WRITE,
+                            MAP_SHARED, *fd, 0);
+  if ( stats == MAP_FAILED){
+    close(*fd);
+    *fd = -1;
+    return NULL;
+  }
+  return stats;
+}
+
+/**
+ * Maps the statistics a server sent over its control socket
+ * @param fd the memfd received from the server
+ * @return the read-only mapping, NULL on error
+ */
+const ServerStats* stats_map ( int fd ){
+  void* stats = mmap(NULL, sizeof(ServerStats), PROT_READ, MAP_SHARED, fd, 0);
+  return stats == MAP_FAILED ? NULL : stats;
+}
+
+/**
+ * Unmaps statistics returned by stats_create() or stats_map()
+ */
+void stats_unmap ( const ServerStats* stats ){
+  if ( stats != NULL){
+    munmap((void*) stats, sizeof(ServerStats));
+  }
+}
+
+/**
+ * Returns how many slots readers need to scan
+ * Reading past them would fault in pages of the memfd for nothing.
+ * @param stats the server's statistics
+ * @return one past the highest slot ever taken
+ */
+int stats_slots ( const ServerStats* stats ){
+  uint32_t used = atomic_load(&stats->slots_used);
+  return used < MAX_REPLICAS ? (int) used : MAX_REPLICAS;
+}
+
+/**
+ * Counts the replicas of a server that are currently running
+ * @param stats the server's statistics
+ * @return the number of occupied slots
+ */
+int stats_live_replicas ( const ServerStats* stats ){
+  int i, live = 0, slots = stats_slots(stats);
+  for ( i = 0; i < slots; ++i){
+    if ( atomic_load(&stats->replicas[i].pid) != 0){
+      live++;
+    }
+  }
+  return live;
+}
+
+/**
+ * Sums the load of the replicas of a server
+ * Gauges only count running replicas, as one that died mid-job leaves
+ * them behind. Counters keep the jobs of replicas that exited.
+ * @param stats the server's statistics
+ * @param load filled with the sums
+ */
+void stats_load ( const ServerStats* stats, ServerLoad* load ){
+  int i, slots = stats_slots(stats);
+  memset(load, 0, sizeof(ServerLoad));
+  for ( i = 0; i < slots; ++i){
+    const ReplicaStats* replica = &stats->replicas[i];
+    load->rejected += atomic_load(&replica->rejected);
+    load->shed += atomic_load(&replica->shed);
+    if ( atomic_load(&replica->pid) == 0){
+      continue;
+    }
+    load->in_flight += atomic_load(&replica->in_flight);
+    load->queued += atomic_load(&replica->queued);
+    load->overloaded += atomic_load(&replica->overloaded);
+    if ( atomic_load(&replica->peak_in_flight) > load->peak){
+      load->peak = atomic_load(&replica->peak_in_flight);
+    }
+  }
+}
+
+/**
+ * Merges the latencies of all the replicas of a server
+ * Slots of replicas that exited are kept, their jobs still count.
+ * @param stats the server's statistics
+ * @param merged a zeroed histogram that receives the sum
+ */
+void stats_merge_latency ( const ServerStats* stats, Histogram* merged ){
+  int i, slots = stats_slots(stats);
+  for ( i = 0; i < slots; ++i){
+    hist_merge(merged, &stats->replicas[i].latency);
+  }
+}
@@ -0,0 +1,104 @@
+#ifndef H_STATS
+#define H_STATS
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include "histogram.h"
+
+/***********************************************
+* Statistics a server shares with its manager
+* The server maps them before replicating so every replica
+* writes into its own slot without any system call, and
+* sends the backing memfd to the manager, which maps it
+* read-only and merges the slots when asked for a status.
+* Author: Gloire Rubambiza
+* Version: 10/20/2017
+***********************************************/
+
+// Thread-mode servers may run thousands of replicas. Slots are only
+// touched once used, so the unused tail of the memfd stays unallocated.
+#define MAX_REPLICAS 1024
+
+// Statistics of a single replica, written by that replica only
+typedef struct ReplicaStats {
+  _Atomic pid_t pid;                 // 0 when the slot is free
+  _Atomic uint32_t in_flight;        // Jobs its coroutines are running
+  _Atomic uint32_t peak_in_flight;   // Most jobs it ever ran at once
+  _Atomic uint32_t queued;           // Accepted jobs waiting for a coroutine
+  _Atomic bool overloaded;           // Its queue is full
+  _Atomic uint64_t rejected;         // New jobs turned away while overloaded
+  _Atomic uint64_t shed;             // Queued jobs dropped, stale or displaced
+  Histogram latency;                 // Nanoseconds per job
+} ReplicaStats;
+
+typedef struct ServerStats {
+  _Atomic uint64_t replica_spawns;   // Replicas forked since the server started
+  _Atomic uint64_t replica_exits;    // Replicas reaped since the server started
+  _Atomic uint32_t slots_used;       // One past the highest slot ever taken
+  _Atomic bool thread_mode;          // Replicas are threads of the server
+  _Atomic uint32_t concurrency;      // Jobs each replica may run at once
+  _Atomic uint32_t queue_limit;      // Jobs each replica may hold waiting
+  ReplicaStats replicas[MAX_REPLICAS];
+} ServerStats;
+
+// Load of a server summed over its replicas
+typedef struct ServerLoad {
+  uint32_t in_flight;                // Jobs running now
+  uint32_t peak;                     // Most any running replica ran at once
+  uint32_t queued;                   // Jobs waiting now
+  uint32_t overloaded;               // Replicas with a full queue
+  uint64_t rejected;
+  uint64_t shed;
+} ServerLoad;
+
+// Sent by a replica over the control socket when it becomes overloaded
+// or recovers, so the manager hears of it without polling the statistics
+typedef struct LoadNotice {
+  int32_t slot;
+  int32_t overloaded;
+} LoadNotice;
+
+/**
+ * Creates the shared statistics of a server
+ * @param fd set to the memfd backing the statistics
+ * @return the mapped statistics, NULL on error
+ */
+ServerStats* stats_create ( int* fd );
+
+/**
+ * Maps the statistics a server sent over its control socket
+ * @param fd the memfd received from the server
+ * @return the read-only mapping, NULL on error
+ */
+const ServerStats* stats_map ( int fd );
+
+/**
+ * Unmaps statistics returned by stats_create() or stats_map()
+ */
+void stats_unmap ( const ServerStats* stats );
+
+/**
+ * Returns how many slots readers need to scan, the ones ever taken
+ */
+int stats_slots ( const ServerStats* stats );
+
+/**
+ * Counts the replicas of a server that are currently running
+ */
+int stats_live_replicas ( const ServerStats* stats );
+
+/**
+ * Sums the load of the replicas of a server
+ * @param stats the server's statistics
+ * @param load filled with the sums
+ */
+void stats_load ( const ServerStats* stats, ServerLoad* load );
+
+/**
+ * Merges the latencies of all the replicas of a server
+ * @param stats the server's statistics
+ * @param merged a zeroed histogram that receives the sum
+ */
+void stats_merge_latency ( const ServerStats* stats, Histogram* merged );
+
+#endif
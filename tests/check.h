@@ -0,0 +1,37 @@
+#ifndef H_CHECK
+#define H_CHECK
+#include <stdio.h>
+
+/***********************************************
+* Minimal checks for the unit tests, run with make test
+* A failed check reports itself and the test goes on, so
+* one run shows every failure; main returns test_result().
+* Author: Gloire Rubambiza
+* Version: 10/31/2017
+***********************************************/
+
+static int check_failures = 0;
+
+#define CHECK(cond) do { \
+    if ( !(cond)){ \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+              #cond); \
+      check_failures++; \
+    } \
+  } while (0)
+
+/**
+ * Reports how the test went
+ * @param name the test's name
+ * @return the test's exit status, 0 when every check passed
+ */
+static inline int test_result ( const char* name ){
+  if ( check_failures > 0){
+    fprintf(stderr, "%s: %d checks failed\n", name, check_failures);
+    return 1;
+  }
+  printf("%s: ok\n", name);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "check.h"
+#include "../eventlog.h"
+
+/*****************************************************
+* Tests of the lock-free event ring
+* Events carry their producer in a and a sequence in b,
+* the log is read back to see which made it and in what order.
+* Author: Gloire Rubambiza
+* Version: 10/31/2017
+******************************************************/
+
+#define NUM_PRODUCERS 4
+#define EVENTS_PER_PRODUCER 100000
+#define YIELD_EVERY 64                 // Lets the flush run on a single CPU
+#define LINE_SIZE 512
+
+static atomic_int producing;
+
+/**
+ * Points the log of this process at a new empty file
+ * @param path a mkstemp() template, receives the file's name
+ */
+static void log_to_temp ( char* path ){
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  close(fd);
+  setenv(EVENT_LOG_ENV, path, 1);
+  unsetenv(EVENT_LEVEL_ENV);
+  unsetenv(EVENT_SAMPLE_ENV);
+  eventlog_init("test");
+}
+
+/**
+ * Reads back the log, checking every producer's events are in order
+ * @param path the log file, removed once read
+ * @param last receives, per producer, the sequence of its last event
+ * @param dropped receives the events the ring reported dropped
+ * @return the number of events read
+ */
+static long read_log ( const char* path, long last[], long* dropped ){
+  FILE* log = fopen(path, "r");
+  char line[LINE_SIZE];
+  long events = 0, count, producer, sequence;
+  int i;
+  for ( i = 0; i < NUM_PRODUCERS; ++i){
+    last[i] = -1;
+  }
+  *dropped = 0;
+  while ( log != NULL && fgets(line, sizeof(line), log) != NULL){
+    char* field;
+    if ( (field = strstr(line, "\"count\":")) != NULL &&
+         sscanf(field, "\"count\":%ld", &count) == 1){
+      *dropped += count;
+    } else if ( (field = strstr(line, "\"replica_pid\":")) != NULL &&
+                sscanf(field, "\"replica_pid\":%ld,\"slot\":%ld", &producer,
+                       &sequence) == 2){
+      CHECK(producer >= 0 && producer < NUM_PRODUCERS);
+      CHECK(sequence > last[producer]);
+      last[producer] = sequence;
+      events++;
+    } else {
+      CHECK(!"malformed line");
+    }
+  }
+  if ( log != NULL){
+    fclose(log);
+  }
+  unlink(path);
+  return events;
+}
+
+/**
+ * A full ring keeps what it holds and counts what it turned away
+ */
+static void test_full_ring (){
+  char path[] = "/tmp/scs_eventlog_XXXXXX";
+  long last[NUM_PRODUCERS], dropped;
+  int i;
+  log_to_temp(path);
+  for ( i = 0; i < EVENTLOG_CAPACITY + 10; ++i){
+    eventlog_emit(LOG_INFO, EV_REPLICA_SPAWNED, NULL, 0, i);
+  }
+  eventlog_flush();
+  CHECK(read_log(path, last, &dropped) == EVENTLOG_CAPACITY);
+  CHECK(dropped == 10);
+  CHECK(last[0] == EVENTLOG_CAPACITY - 1);
+}
+
+/**
+ * Emits a producer's events as fast as it can
+ */
+static void* produce ( void* arg ){
+  long producer = (long) arg, i;
+  for ( i = 0; i < EVENTS_PER_PRODUCER; ++i){
+    eventlog_emit(LOG_INFO, EV_REPLICA_SPAWNED, NULL, producer, i);
+    if ( i % YIELD_EVERY == 0){
+      sched_yield();
+    }
+  }
+  atomic_fetch_sub(&producing, 1);
+  return NULL;
+}
+
+/**
+ * Producers race each other around the ring many times over while it
+ * is flushed: no event is torn, duplicated or reordered, and every one
+ * is either written or counted as dropped
+ */
+static void test_wraparound (){
+  char path[] = "/tmp/scs_eventlog_XXXXXX";
+  pthread_t threads[NUM_PRODUCERS];
+  long last[NUM_PRODUCERS], dropped, i;
+  log_to_temp(path);
+  atomic_store(&producing, NUM_PRODUCERS);
+  for ( i = 0; i < NUM_PRODUCERS; ++i){
+    pthread_create(&threads[i], NULL, produce, (void*) i);
+  }
+  while ( atomic_load(&producing) > 0){
+    eventlog_flush();
+    sched_yield();
+  }
+  for ( i = 0; i < NUM_PRODUCERS; ++i){
+    pthread_join(threads[i], NULL);
+  }
+  eventlog_flush();
+
+  long events = read_log(path, last, &dropped);
+  CHECK(events + dropped == (long) NUM_PRODUCERS * EVENTS_PER_PRODUCER);
+  CHECK(events > 8 * EVENTLOG_CAPACITY); // Or the ring hardly wrapped
+}
+
+int main (){
+  test_full_ring();
+  test_wraparound();
+  return test_result("eventlog");
+}
@@ -0,0 +1,72 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "check.h"
+#include "../fdpass.h"
+
+/*****************************************************
+* Tests of passing descriptors over a Unix socket
+* Author: Gloire Rubambiza
+* Version: 10/31/2017
+******************************************************/
+
+/**
+ * Descriptors sent with a message arrive as working copies, in order
+ */
+static void test_round_trip (){
+  int sv[2], pipes[MAX_PASSED_FDS][2], sent[MAX_PASSED_FDS];
+  int received[MAX_PASSED_FDS], num_received = -1, i;
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == 0);
+  for ( i = 0; i < MAX_PASSED_FDS; ++i){
+    CHECK(pipe(pipes[i]) == 0);
+    sent[i] = pipes[i][1];
+  }
+
+  const char message[] = "listeners";
+  char buf[sizeof(message)];
+  CHECK(send_msg_fds(sv[0], message, sizeof(message), sent,
+                     MAX_PASSED_FDS) == 0);
+  CHECK(recv_msg_fds(sv[1], buf, sizeof(buf), received, MAX_PASSED_FDS,
+                     &num_received) == sizeof(message));
+  CHECK(memcmp(buf, message, sizeof(message)) == 0);
+  CHECK(num_received == MAX_PASSED_FDS);
+
+  // Each copy writes into the pipe its original belongs to
+  for ( i = 0; i < num_received && i < MAX_PASSED_FDS; ++i){
+    char byte = (char) i, back = -1;
+    CHECK(received[i] != sent[i]);
+    CHECK(write(received[i], &byte, 1) == 1);
+    CHECK(read(pipes[i][0], &back, 1) == 1 && back == byte);
+    close(pipes[i][0]);
+  }
+  close_fds(received, &num_received);
+  CHECK(num_received == 0);
+  for ( i = 0; i < MAX_PASSED_FDS; ++i){
+    close(sent[i]);
+  }
+  close(sv[0]);
+  close(sv[1]);
+}
+
+/**
+ * An empty batch is a valid one, and more than MAX_PASSED_FDS is refused
+ */
+static void test_batch_sizes (){
+  int sv[2], fds[MAX_PASSED_FDS + 1], i;
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == 0);
+  CHECK(send_fds(sv[0], NULL, 0) == 0);
+  CHECK(recv_fds(sv[1], fds, MAX_PASSED_FDS) == 0);
+
+  for ( i = 0; i <= MAX_PASSED_FDS; ++i){
+    fds[i] = sv[0];
+  }
+  CHECK(send_fds(sv[0], fds, MAX_PASSED_FDS + 1) < 0);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+int main (){
+  test_round_trip();
+  test_batch_sizes();
+  return test_result("fdpass");
+}
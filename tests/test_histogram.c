@@ -0,0 +1,80 @@
+#include <string.h>
+#include "check.h"
+#include "../histogram.h"
+
+/*****************************************************
+* Tests of the log-linear histogram's buckets
+* Author: Gloire Rubambiza
+* Version: 10/31/2017
+******************************************************/
+
+static Histogram hist, merged;
+
+/**
+ * Values below HIST_SUB_BUCKETS have a bucket each, so come back exact
+ */
+static void test_exact_values (){
+  uint64_t value;
+  for ( value = 0; value < HIST_SUB_BUCKETS; ++value){
+    memset(&hist, 0, sizeof(hist));
+    hist_record(&hist, value);
+    hist_record(&hist, UINT64_MAX); // Keeps max from capping the answer
+    CHECK(hist_percentile(&hist, 50) == value);
+  }
+}
+
+/**
+ * On either side of every power of two, a value comes back within the
+ * width of its bucket, 1/HIST_SUB_BUCKETS of it
+ */
+static void test_bucket_boundaries (){
+  int exponent, delta;
+  for ( exponent = HIST_SUB_BUCKET_BITS; exponent < 64; ++exponent){
+    for ( delta = -1; delta <= 1; ++delta){
+      uint64_t value = (1ULL << exponent) + delta;
+      memset(&hist, 0, sizeof(hist));
+      hist_record(&hist, value);
+      hist_record(&hist, value);
+      hist_record(&hist, UINT64_MAX);
+      uint64_t found = hist_percentile(&hist, 50);
+      uint64_t error = found > value ? found - value : value - found;
+      CHECK(error <= value / HIST_SUB_BUCKETS);
+    }
+  }
+}
+
+/**
+ * The answer never exceeds the largest value recorded, and an empty
+ * histogram answers 0
+ */
+static void test_max_and_empty (){
+  memset(&hist, 0, sizeof(hist));
+  CHECK(hist_percentile(&hist, 99) == 0);
+  hist_record(&hist, 1000);
+  CHECK(hist_percentile(&hist, 100) == 1000);
+}
+
+/**
+ * Merging adds up counts, totals and sums, and keeps the larger max
+ */
+static void test_merge (){
+  int i;
+  memset(&hist, 0, sizeof(hist));
+  memset(&merged, 0, sizeof(merged));
+  for ( i = 1; i <= 100; ++i){
+    hist_record(&hist, i);
+  }
+  hist_merge(&merged, &hist);
+  hist_merge(&merged, &hist);
+  CHECK(merged.total == 200 && merged.sum == 2 * 5050 && merged.max == 100);
+  uint64_t median = hist_percentile(&merged, 50);
+  CHECK(median >= 48 && median <= 52);
+}
+
+int main (){
+  test_exact_values();
+  test_bucket_boundaries();
+  test_max_and_empty();
+  test_merge();
+  return test_result("histogram");
+}
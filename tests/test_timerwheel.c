@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include "check.h"
+#include "../timerwheel.h"
+
+/*****************************************************
+* Tests of the hierarchical timer wheel
+* Author: Gloire Rubambiza
+* Version: 10/31/2017
+******************************************************/
+
+#define START 123457                   // Not aligned on any level
+#define NUM_RANDOM 20000
+
+/**
+ * Runs the wheel the way the manager's loop does, sleeping as long as
+ * wheel_next() allows, and checks every timer fires on its tick
+ * @return the number of timers fired
+ */
+static int run_on_time ( TimerWheel* wheel ){
+  int fired = 0;
+  long ticks;
+  while ( (ticks = wheel_next(wheel)) >= 0){
+    uint64_t now = wheel->now + ticks;
+    Timer* timer;
+    for ( timer = wheel_advance(wheel, now); timer != NULL;
+          timer = timer->next){
+      CHECK(timer->expires == now);
+      fired++;
+    }
+  }
+  return fired;
+}
+
+/**
+ * Timers go in the level their delay fits in, and come down a level
+ * at a time to fire on their very tick
+ */
+static void test_cascade (){
+  const uint64_t delays[] = { 1, 2, 63, 64, 65, 4095, 4096, 4097, 262143,
+                              262144, 262145, 5000000 };
+  const int levels[] = { 0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3 };
+  int i, num = sizeof(delays) / sizeof(delays[0]);
+  Timer timers[sizeof(delays) / sizeof(delays[0])] = {{ 0 }};
+  TimerWheel wheel;
+  wheel_init(&wheel, START);
+  for ( i = 0; i < num; ++i){
+    wheel_add(&wheel, &timers[i], START + delays[i]);
+    CHECK(timers[i].level == levels[i]);
+  }
+  CHECK(wheel_next(&wheel) == 1);
+  CHECK(run_on_time(&wheel) == num);
+  CHECK(wheel_next(&wheel) == -1);
+  for ( i = 0; i < num; ++i){
+    CHECK(timers[i].link == NULL);
+  }
+}
+
+/**
+ * Delays past the top level wait in its last slot, then are placed
+ * again and still fire on their tick
+ */
+static void test_clamping (){
+  uint64_t top = 1ULL << (WHEEL_BITS * WHEEL_LEVELS);
+  Timer far = { 0 }, farther = { 0 };
+  TimerWheel wheel;
+  wheel_init(&wheel, START);
+  wheel_add(&wheel, &far, START + top + 1000);
+  wheel_add(&wheel, &farther, START + 2 * top);
+  CHECK(far.level == WHEEL_LEVELS - 1 && farther.level == WHEEL_LEVELS - 1);
+  CHECK(run_on_time(&wheel) == 2);
+  CHECK(wheel.now == START + 2 * top);
+}
+
+/**
+ * A timer already due fires on the next tick, and a removed one never
+ */
+static void test_due_and_removed (){
+  Timer due = { 0 }, removed = { 0 }, kept = { 0 };
+  TimerWheel wheel;
+  wheel_init(&wheel, START);
+  wheel_add(&wheel, &due, START - 10);
+  wheel_add(&wheel, &removed, START + 5000);
+  wheel_add(&wheel, &kept, START + 5000);
+  wheel_remove(&wheel, &removed);
+  wheel_remove(&wheel, &removed); // Idle timers are left alone
+
+  Timer* expired = wheel_advance(&wheel, START + 1);
+  CHECK(expired == &due && due.next == NULL);
+  expired = wheel_advance(&wheel, START + 5000);
+  CHECK(expired == &kept && kept.next == NULL);
+  CHECK(removed.link == NULL && wheel_next(&wheel) == -1);
+
+  // Nothing queued, so the wheel jumps instead of visiting every tick
+  CHECK(wheel_advance(&wheel, START + 100000000) == NULL);
+  CHECK(wheel.now == START + 100000000);
+}
+
+/**
+ * Random delays across every level, some removed, advanced by random
+ * steps: each timer left fires exactly once and never early
+ */
+static void test_random (){
+  Timer* timers = calloc(NUM_RANDOM, sizeof(Timer));
+  int* fired = calloc(NUM_RANDOM, sizeof(int));
+  const uint64_t spans[] = { 100, 5000, 300000, 20000000 };
+  TimerWheel wheel;
+  int i;
+  srand(1);
+  wheel_init(&wheel, START);
+  for ( i = 0; i < NUM_RANDOM; ++i){
+    wheel_add(&wheel, &timers[i], START + rand() % spans[i % 4]);
+  }
+  for ( i = 0; i < NUM_RANDOM; i += 7){
+    wheel_remove(&wheel, &timers[i]);
+  }
+
+  long ticks;
+  int steps = 0;
+  while ( (ticks = wheel_next(&wheel)) >= 0){
+    // Every third step sleeps as told, the others wake up early or late
+    uint64_t now = wheel.now + (++steps % 3 == 0 ? ticks
+                                                  : rand() % (2 * ticks) + 1);
+    Timer* timer;
+    for ( timer = wheel_advance(&wheel, now); timer != NULL;
+          timer = timer->next){
+      CHECK(timer->expires <= now);
+      fired[timer - timers]++;
+    }
+  }
+  for ( i = 0; i < NUM_RANDOM; ++i){
+    CHECK(fired[i] == (i % 7 == 0 ? 0 : 1));
+  }
+  free(timers);
+  free(fired);
+}
+
+int main (){
+  test_cascade();
+  test_clamping();
+  test_due_and_removed();
+  test_random();
+  return test_result("timerwheel");
+}
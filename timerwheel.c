@@ -0,0 +1,161 @@
+#include <string.h>
+#include "timerwheel.h"
+
+/*****************************************************
+* Hierarchical timer wheel, as in the Linux kernel's
+* Author: Gloire Rubambiza
+* Version: 10/31/2017
+******************************************************/
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN(level) (1ULL << (WHEEL_BITS * (level)))
+
+/**
+ * Empties a wheel and starts it at the given tick
+ * @param wheel the wheel
+ * @param now the current tick
+ */
+void wheel_init ( TimerWheel* wheel, uint64_t now ){
+  memset(wheel, 0, sizeof(TimerWheel));
+  wheel->now = now;
+}
+
+/**
+ * Queues a timer in the slot of the given tick
+ * A delay beyond the top level waits in its last slot, and is placed
+ * again when that slot comes around.
+ */
+static void place ( TimerWheel* wheel, Timer* timer, uint64_t at ){
+  uint64_t delay = at - wheel->now;
+  int level = 0;
+  while ( level < WHEEL_LEVELS - 1 && delay >= WHEEL_SPAN(level + 1)){
+    level++;
+  }
+  if ( delay >= WHEEL_SPAN(WHEEL_LEVELS)){
+    at = wheel->now + WHEEL_SPAN(WHEEL_LEVELS) - 1;
+  }
+
+  Timer** slot = &wheel->slots[level][(at >> (WHEEL_BITS * level))
+                                      & WHEEL_MASK];
+  timer->level = level;
+  timer->next = *slot;
+  if ( timer->next != NULL){
+    timer->next->link = &timer->next;
+  }
+  timer->link = slot;
+  *slot = timer;
+  wheel->counts[level]++;
+}
+
+/**
+ * Adds a timer, due on the next tick if that one has passed
+ * @param wheel the wheel
+ * @param timer the timer, not queued
+ * @param expires the tick it is due on
+ */
+void wheel_add ( TimerWheel* wheel, Timer* timer, uint64_t expires ){
+  timer->expires = expires;
+  place(wheel, timer, expires > wheel->now ? expires : wheel->now + 1);
+}
+
+/**
+ * Removes a timer, if it is queued
+ * @param wheel the wheel
+ * @param timer the timer
+ */
+void wheel_remove ( TimerWheel* wheel, Timer* timer ){
+  if ( timer->link == NULL){
+    return;
+  }
+  *timer->link = timer->next;
+  if ( timer->next != NULL){
+    timer->next->link = timer->link;
+  }
+  timer->next = NULL;
+  timer->link = NULL;
+  wheel->counts[timer->level]--;
+}
+
+/**
+ * Places the timers of a slot again, one level down or more
+ */
+static void cascade ( TimerWheel* wheel, int level ){
+  Timer** slot = &wheel->slots[level][(wheel->now >> (WHEEL_BITS * level))
+                                      & WHEEL_MASK];
+  Timer* timer = *slot;
+  *slot = NULL;
+  while ( timer != NULL){
+    Timer* next = timer->next;
+    wheel->counts[level]--;
+    // The current tick's slot is yet to expire, so it may land there
+    place(wheel, timer, timer->expires > wheel->now ? timer->expires
+                                                    : wheel->now);
+    timer = next;
+  }
+}
+
+/**
+ * Advances to the given tick
+ * Every tick in between is visited, which costs little next to what
+ * the timers do, and is skipped altogether while the wheel is empty.
+ * @param wheel the wheel
+ * @param now the current tick
+ * @return the timers that came due, linked through next, NULL for none
+ */
+Timer* wheel_advance ( TimerWheel* wheel, uint64_t now ){
+  Timer* expired = NULL, **tail = &expired;
+  while ( wheel->now < now){
+    size_t queued = 0;
+    int level;
+    for ( level = 0; level < WHEEL_LEVELS; ++level){
+      queued += wheel->counts[level];
+    }
+    if ( queued == 0){
+      wheel->now = now;
+      break;
+    }
+
+    wheel->now++;
+    for ( level = 1; level < WHEEL_LEVELS &&
+                     (wheel->now & (WHEEL_SPAN(level) - 1)) == 0; ++level){
+      cascade(wheel, level);
+    }
+    Timer** slot = &wheel->slots[0][wheel->now & WHEEL_MASK];
+    while ( *slot != NULL){
+      Timer* timer = *slot;
+      wheel_remove(wheel, timer);
+      *tail = timer;
+      tail = &timer->next;
+    }
+  }
+  return expired;
+}
+
+/**
+ * Returns how many ticks the wheel may go without advancing
+ * That is until the first timer of level 0, or the next time it wraps
+ * while higher levels hold timers that may come down.
+ * @param wheel the wheel
+ * @return the ticks, -1 if it is empty
+ */
+long wheel_next ( const TimerWheel* wheel ){
+  long next = -1;
+  int level;
+  for ( level = 1; level < WHEEL_LEVELS; ++level){
+    if ( wheel->counts[level] > 0){
+      next = WHEEL_SLOTS - (wheel->now & WHEEL_MASK);
+      break;
+    }
+  }
+  if ( wheel->counts[0] == 0){
+    return next;
+  }
+  long ticks;
+  for ( ticks = 1; ticks <= WHEEL_SLOTS && (next < 0 || ticks < next);
+        ++ticks){
+    if ( wheel->slots[0][(wheel->now + ticks) & WHEEL_MASK] != NULL){
+      return ticks;
+    }
+  }
+  return next;
+}
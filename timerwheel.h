@@ -0,0 +1,63 @@
+#ifndef H_TIMERWHEEL
+#define H_TIMERWHEEL
+#include <stdint.h>
+#include <stddef.h>
+
+/***********************************************
+* Hierarchical timer wheel
+* Level 0 has a slot per tick, each level above one per
+* WHEEL_SLOTS ticks of the level below. A timer goes in the
+* lowest level its delay fits in, and moves down a level each
+* time the wheel below wraps, so adding, removing and expiring
+* cost the same with one timer or thousands.
+* Author: Gloire Rubambiza
+* Version: 10/31/2017
+***********************************************/
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4                 // 2^24 ticks, 194 days of seconds
+
+// Embedded in whatever it times, first so the expired list casts back
+typedef struct Timer {
+  struct Timer* next;
+  struct Timer** link;                 // What points at it, NULL when idle
+  uint64_t expires;                    // The tick it is due on
+  int level;
+} Timer;
+
+typedef struct TimerWheel {
+  uint64_t now;                        // The last tick advanced to
+  Timer* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  size_t counts[WHEEL_LEVELS];
+} TimerWheel;
+
+/**
+ * Empties a wheel and starts it at the given tick
+ */
+void wheel_init ( TimerWheel* wheel, uint64_t now );
+
+/**
+ * Adds a timer, due on the next tick if that one has passed
+ * @param expires the tick it is due on
+ */
+void wheel_add ( TimerWheel* wheel, Timer* timer, uint64_t expires );
+
+/**
+ * Removes a timer, if it is queued
+ */
+void wheel_remove ( TimerWheel* wheel, Timer* timer );
+
+/**
+ * Advances to the given tick
+ * @return the timers that came due, linked through next, NULL for none
+ */
+Timer* wheel_advance ( TimerWheel* wheel, uint64_t now );
+
+/**
+ * Returns how many ticks the wheel may go without advancing
+ * @return the ticks, -1 if it is empty
+ */
+long wheel_next ( const TimerWheel* wheel );
+
+#endif
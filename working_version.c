@@ -5,14 +5,56 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <spawn.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
 #include <signal.h>
 #include <time.h>
 #include "manager.h"
+#include "metrics.h"
+#include "eventlog.h"
+#include "ioloop.h"
 #define MAX_SERVERS 10
 #define MIN_REPLICAS 2
 #define STR_BUFFER_SIZE 255 // A linux file cannot be >255 characters long
-#define MAX_ARGS 6
+#define MAX_ARGS 64 // onNode batches several commands on one line
+#define NUM_BUFFER_SIZE 12
+
+// Counters of the manager's own activity, exported as metrics
+typedef struct ManagerCounters {
+  unsigned long servers_created;
+  unsigned long servers_aborted;
+} ManagerCounters;
+
+extern char** environ;
+
+int server_count = 0;
+ManagerCounters counters;
+Histogram command_latency;
+
+// The helper that starts every server, and the last request sent to it
+int spawner_fd = -1;
+pid_t spawner_pid = -1;
+
+// Reaps the spawner and any server reparented to us
+ChildWatch child_watch;
+uint32_t spawn_sequence = 0;
+
+// Agents of other hosts, and the controllers connected to our own agent
+Node nodes[MAX_NODES];
+AgentClient agent_clients[MAX_AGENT_CLIENTS];
+
+// PSI triggers, and the resources found under pressure on the last look
+PressureMonitor pressure;
+unsigned pressured = 0;
+
+// Daily scale rules, on a wheel ticking each second of the monotonic clock
+TimerWheel schedule;
+ScaleRule* scale_rules = NULL;
 
 /*****************************************************
 * Main server manager that creates all servers
@@ -29,10 +71,104 @@ Fills the server's struct for housekeeping purposes
 * @param arguments the parameters passed by the user
 */
 void fill_struct(Server* server, const char* name, int limits[]){
-  server->name = malloc(sizeof(ServerName));
-  strcpy(server->name, name);
+  server->name = strdup(name);
   server->active_processes = limits[0];
+  server->min_process = limits[0];
   server->max_process = limits[1];
+  server->deferred = 0;
+  server->scaled_at = 0;
+  server->num_options = 0;
+  server->control_fd = -1;
+  server->num_listen_fds = 0;
+  server->stats = NULL;
+  server->restarts = 0;
+  server->state = SERVER_RUNNING;
+  server->crash_index = 0;
+  server->backoff_level = 0;
+  server->crashes = 0;
+  memset(server->crash_times, 0, sizeof(server->crash_times));
+  server->handshake = HANDSHAKE_DONE;
+  server->retiring_pid = 0;
+  server->overloaded = false;
+}
+
+/**
+ * Returns the monotonic time in seconds
+ */
+double now_seconds (){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Releases a server struct once its server has shut down
+ * Closes the control socket and the listeners held for restarts
+ * @param server the struct to be released
+ */
+void release_struct (Server* server){
+  free(server->name);
+  server->name = NULL;
+  if ( server->control_fd >= 0){
+    close(server->control_fd);
+    server->control_fd = -1;
+  }
+  close_fds(server->listen_fds, &server->num_listen_fds);
+  stats_unmap(server->stats);
+  server->stats = NULL;
+  int i;
+  for ( i = 0; i < server->num_options; ++i){
+    free(server->options[i]);
+  }
+  server->num_options = 0;
+}
+
+/**
+ * Keeps the options of a server so respawns get the same ones
+ * @param server the struct of the server
+ * @param tokens the createServer command, options start at tokens[5]
+ * @return 0 on success, -1 if an option has an invalid value or there are
+ * more than MAX_OPTIONS
+ */
+int store_options ( Server* server, char* tokens[] ){
+  int i;
+  server->qos = QOS_STANDARD;
+  for ( i = 5; tokens[i] != NULL; ++i){
+    if ( server->num_options == MAX_OPTIONS){
+      fprintf(stderr, "ERROR: a server takes at most %d options, including "
+              "its port\n", MAX_OPTIONS);
+      return -1;
+    }
+    server->options[server->num_options++] = strdup(tokens[i]);
+    if ( strncmp(tokens[i], "qos=", 4) == 0){
+      int qos = qos_parse(tokens[i] + 4);
+      if ( qos < 0){
+        fprintf(stderr, "ERROR: unknown qos class %s, expected "
+                "critical|standard|batch|idle\n", tokens[i] + 4);
+        return -1;
+      }
+      server->qos = qos;
+    } else if ( strncmp(tokens[i], "cpus=", 5) == 0 &&
+                qos_check_cpus(tokens[i] + 5) < 0){
+      fprintf(stderr, "ERROR: invalid CPU list %s, expected a list such as "
+              "0,2-3\n", tokens[i] + 5);
+      return -1;
+    } else if ( strncmp(tokens[i], "mode=", 5) == 0 &&
+                strcmp(tokens[i] + 5, "thread") != 0 &&
+                strcmp(tokens[i] + 5, "process") != 0){
+      fprintf(stderr, "ERROR: unknown mode %s, expected thread|process\n",
+              tokens[i] + 5);
+      return -1;
+    } else if ( strncmp(tokens[i], "overload=", 9) == 0 &&
+                strcmp(tokens[i] + 9, "queue") != 0 &&
+                strcmp(tokens[i] + 9, "shed") != 0 &&
+                strcmp(tokens[i] + 9, "reject") != 0){
+      fprintf(stderr, "ERROR: unknown overload policy %s, expected "
+              "queue|shed|reject\n", tokens[i] + 9);
+      return -1;
+    }
+  }
+  return 0;
 }
 
 /**
@@ -45,21 +181,654 @@ void update_struct (Server* server, pid_t* pid){
 
 /**
 * Sends the server to execute in a different process
+* The spawner helper starts it, so the manager never forks. The server gets
+* one end of a control socket, over which it receives the listeners we hold
+* for it and sends back the ones it ends up using; the rest of the handshake
+* happens in the event loop once the server is up.
 @param server the server to be created
-@return 0 on successful creation of server, otherwise error
+@param tokens the arguments of the server
+@return 0 once the spawn is requested, -1 on error
 */
-pid_t create_server ( char* tokens[]){
+pid_t create_server ( Server* server, char* tokens[]){
  
-  pid_t pid = fork();
-  if ( pid == 0){
-    execvp(tokens[0], tokens);
+  int sv[2];
+  if ( socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0){
+    perror("socketpair");
+    return -1;
+  }
+
+  // Queue the listeners of a previous instance for the server to pick up
+  server->spawn_id = ++spawn_sequence;
+  if ( send_fds(sv[0], server->listen_fds, server->num_listen_fds) < 0 ||
+       spawner_request(spawner_fd, server->spawn_id, tokens, sv[1]) < 0){
+    fprintf(stderr, "ERROR: could not request server %s: %s\n", server->name,
+            strerror(errno));
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
   }
-  if ( pid == -1){
-    printf("There was an error forking\n\n");
+  close(sv[1]);
+
+  if ( server->control_fd >= 0){
+    close(server->control_fd);
   }
+  server->control_fd = sv[0];
+  server->handshake = HANDSHAKE_LISTENERS;
+  return 0;
+}
+
+/**
+ * Advances the handshake with a new server over its control socket.
+ * The server first reports its listeners, which we keep so the next
+ * instance can inherit them, then the memfd of its statistics. Once done,
+ * the instance it replaces, if any, is shut down.
+ * @param server the struct of the server
+ */
+void continue_handshake ( Server* server ){
+  if ( server->handshake == HANDSHAKE_LISTENERS){
+    int fds[MAX_PASSED_FDS];
+    int num_fds = recv_fds(server->control_fd, fds, MAX_PASSED_FDS);
+    if ( num_fds < 0){ // The server died, the spawner reports its exit
+      fprintf(stderr, "ERROR: listener handoff with server %s failed\n",
+              server->name);
+      server->handshake = HANDSHAKE_DONE;
+      return;
+    }
+    close_fds(server->listen_fds, &server->num_listen_fds);
+    memcpy(server->listen_fds, fds, sizeof(int) * num_fds);
+    server->num_listen_fds = num_fds;
+    server->handshake = HANDSHAKE_STATS;
+    return;
+  }
+
+  // The server then shares the memory its replicas record statistics in
+  int stats_fd;
+  if ( recv_fds(server->control_fd, &stats_fd, 1) == 1){
+    stats_unmap(server->stats);
+    server->stats = stats_map(stats_fd);
+    close(stats_fd);
+  }
+  server->handshake = HANDSHAKE_DONE;
+  update_overload(server);
+
+  if ( server->retiring_pid > 0){
+    kill(server->retiring_pid, SIGUSR1);
+    eventlog_emit(LOG_INFO, EV_SERVER_RESTARTED, server->name,
+                  server->server_pid, server->retiring_pid);
+    server->retiring_pid = 0;
+  }
+}
+
+/**
+ * Reads the overload notices a running server's replicas sent.
+ * They only wake us up, the statistics say which replicas are overloaded.
+ * @param server the struct of the server
+ */
+void read_load_notices ( Server* server ){
+  LoadNotice notice;
+  ssize_t got;
+  while ( (got = recv(server->control_fd, &notice, sizeof(notice),
+                      MSG_DONTWAIT)) == sizeof(notice));
+  if ( got == 0 || (got < 0 && errno != EAGAIN)){
+    close(server->control_fd); // Gone, the spawner reports its exit
+    server->control_fd = -1;
+  }
+  update_overload(server);
+}
+
+/**
+ * Logs a server becoming overloaded, once any replica's queue is full,
+ * or recovering, once none is
+ * @param server the struct of the server
+ */
+void update_overload ( Server* server ){
+  if ( server->stats == NULL){
+    return;
+  }
+  ServerLoad load;
+  stats_load(server->stats, &load);
+  if ( load.overloaded > 0 && !server->overloaded){
+    eventlog_emit(LOG_WARN, EV_SERVER_OVERLOADED, server->name,
+                  load.overloaded, load.queued);
+  } else if ( load.overloaded == 0 && server->overloaded){
+    eventlog_emit(LOG_INFO, EV_SERVER_RECOVERED, server->name,
+                  load.rejected, load.shed);
+  }
+  server->overloaded = load.overloaded > 0;
+}
+
+/**
+ * Starts a new instance of a server from its struct
+ * The new instance inherits the listeners the manager holds for it.
+ * @param server the struct of the server to start
+ * @return 0 once the spawn is requested, -1 on error
+ */
+pid_t respawn_server ( Server* server ){
+  char min[NUM_BUFFER_SIZE], max[NUM_BUFFER_SIZE];
+  snprintf(min, sizeof(min), "%d", server->active_processes);
+  snprintf(max, sizeof(max), "%d", server->max_process);
+  char* args[MAX_OPTIONS + 6] = {"./server.o", "createServer", server->name,
+                                 min, max};
+  int i;
+  for ( i = 0; i < server->num_options; ++i){
+    args[5 + i] = server->options[i];
+  }
+  args[5 + i] = NULL;
+
+  pid_t pid = create_server(server, args);
+  if ( pid < 0){
+    return -1;
+  }
+  update_struct(server, &pid);
+  server->state = SERVER_RUNNING;
+  server->started_at = now_seconds();
   return pid;
 }
 
+/**
+ * Restarts a server without a window where its port refuses connections.
+ * The new instance inherits the listeners before the old one is shut down,
+ * which only happens once the new one finished its handshake, so
+ * connections queued in the meantime are accepted by the new replicas.
+ * @param server the struct of the server to restart
+ * @return 0 once the new instance is requested, -1 on error
+ */
+pid_t restart_server ( Server* server ){
+  pid_t old_pid = server->server_pid;
+  if ( old_pid == 0 && server->state == SERVER_RUNNING){
+    // Restarted again before the spawner answered, the instance still
+    // serving stays until the newest is up, the one in between is
+    // stopped once its result arrives
+    old_pid = server->retiring_pid;
+  } else if ( server->retiring_pid > 0){ // Restarted again before it was up
+    kill(server->retiring_pid, SIGUSR1);
+  }
+  if ( respawn_server(server) < 0){
+    return -1;
+  }
+  // A server in backoff has nothing left to stop
+  server->retiring_pid = old_pid > 0 ? old_pid : 0;
+  return 0;
+}
+
+/**
+ * Handles a spawn result or a server exit reported by the spawner
+ * @param manager the server manager
+ */
+void handle_spawner ( Server manager[] ){
+  SpawnMessage msg;
+  if ( spawner_receive(spawner_fd, &msg) < 0){
+    return; // The helper died, reap_servers starts a new one
+  }
+  int k;
+  for ( k = 0; k < MAX_SERVERS; ++k){
+    Server* server = &manager[k];
+    if ( server->name == NULL){
+      continue;
+    }
+    if ( msg.type == SPAWN_RESULT && server->spawn_id == msg.id){
+      if ( msg.pid < 0){ // Count a failed spawn like a crash so it backs off
+        fprintf(stderr, "ERROR: could not start server %s: %s\n",
+                server->name, strerror(msg.status));
+        server->handshake = HANDSHAKE_DONE;
+        server->server_pid = 0;
+        server_exited(server, -1);
+      } else {
+        server->server_pid = msg.pid;
+      }
+      return;
+    }
+    if ( msg.type == SPAWN_EXIT && msg.pid > 0 && server->server_pid == msg.pid){
+      server_exited(server, msg.status);
+      return;
+    }
+  }
+  // An instance no struct waits for any more, as its server was aborted
+  // or restarted again in the meantime, would run on unmanaged
+  if ( msg.type == SPAWN_RESULT && msg.pid > 0){
+    kill(msg.pid, SIGUSR1);
+  }
+  // Any exit left is of an instance the manager stopped on purpose
+}
+
+/**
+ * Reaps servers orphaned by a spawner that died, and the spawner itself.
+ * The manager is a child subreaper, so servers whose spawner died are
+ * reparented to it and their exits land here.
+ * @param manager the server manager
+ */
+void reap_servers ( Server manager[] ){
+  pid_t pid;
+  int status, k;
+  while ( (pid = child_watch_reap(&child_watch, &status)) > 0){
+    if ( pid == spawner_pid){
+      close(spawner_fd);
+      spawner_pid = start_spawner(&spawner_fd);
+      child_watch_rearm(&child_watch);
+      // Requests in flight died with it, treat them as failed spawns
+      for ( k = 0; k < MAX_SERVERS; ++k){
+        if ( manager[k].name != NULL && manager[k].state == SERVER_RUNNING &&
+             manager[k].server_pid == 0){
+          server_exited(&manager[k], -1);
+        }
+      }
+      continue;
+    }
+    for ( k = 0; k < MAX_SERVERS; ++k){
+      if ( manager[k].name != NULL && manager[k].server_pid == pid){
+        server_exited(&manager[k], status);
+        break;
+      }
+    }
+  }
+}
+
+/**
+ * Records the unexpected exit of a server, backing off or quarantining it.
+ * Each crash doubles the delay before the next respawn, unless the server
+ * had been up for a whole window. A server exiting CRASH_LIMIT times within
+ * CRASH_WINDOW is quarantined, so a bad binary cannot drive the fork rate.
+ * @param server the struct of the server that exited
+ * @param status the exit status returned by waitpid
+ */
+void server_exited ( Server* server, int status ){
+  double now = now_seconds();
+  eventlog_emit(LOG_WARN, EV_SERVER_CRASHED, server->name, server->server_pid,
+                status);
+  server->server_pid = -1;
+  server->handshake = HANDSHAKE_DONE;
+  server->crashes++;
+  if ( now - server->started_at > CRASH_WINDOW){
+    server->backoff_level = 0;
+  }
+
+  server->crash_times[server->crash_index] = now;
+  server->crash_index = (server->crash_index + 1) % CRASH_LIMIT;
+  double oldest = server->crash_times[server->crash_index];
+  if ( oldest > 0 && now - oldest <= CRASH_WINDOW){
+    server->state = SERVER_QUARANTINED;
+    eventlog_emit(LOG_ERROR, EV_SERVER_QUARANTINED, server->name, CRASH_LIMIT,
+                  (int64_t) CRASH_WINDOW);
+    return;
+  }
+
+  double delay = RESPAWN_BASE_DELAY * (1 << server->backoff_level);
+  if ( delay < RESPAWN_MAX_DELAY){
+    server->backoff_level++;
+  } else {
+    delay = RESPAWN_MAX_DELAY;
+  }
+  server->state = SERVER_BACKOFF;
+  server->respawn_at = now + delay;
+}
+
+/**
+ * Respawns the servers whose backoff has elapsed
+ * @param manager the server manager
+ */
+void respawn_due ( Server manager[] ){
+  double now = now_seconds();
+  int k;
+  for ( k = 0; k < MAX_SERVERS; ++k){
+    Server* server = &manager[k];
+    if ( server->name == NULL || server->state != SERVER_BACKOFF ||
+         server->respawn_at > now){
+      continue;
+    }
+    if ( respawn_server(server) < 0){ // A failed spawn backs off too
+      server->started_at = now;
+      server_exited(server, -1);
+    } else {
+      eventlog_emit(LOG_INFO, EV_SERVER_RESPAWNED, server->name,
+                    server->spawn_id, server->crashes);
+    }
+  }
+}
+
+/**
+ * Returns how long the event loop may sleep before the next respawn
+ * @param manager the server manager
+ * @return the timeout in milliseconds, -1 if no respawn is pending
+ */
+int next_respawn_timeout ( Server manager[] ){
+  double now = now_seconds(), next = -1;
+  int k;
+  for ( k = 0; k < MAX_SERVERS; ++k){
+    if ( manager[k].name != NULL && manager[k].state == SERVER_BACKOFF &&
+         (next < 0 || manager[k].respawn_at < next)){
+      next = manager[k].respawn_at;
+    }
+  }
+  if ( next < 0){
+    return -1;
+  }
+  return next <= now ? 0 : (int) ((next - now) * 1000) + 1;
+}
+
+/**
+ * Retires replicas while the host is under pressure, and starts the
+ * deferred ones once it is not
+ * Adding replicas to a thrashing host only makes every one of them
+ * slower, so each running server above its minimum gives one up per PSI
+ * window instead. Deferred replicas then come back one at a time, giving
+ * the triggers a chance to fire again before the next.
+ * @param manager the server manager
+ * @param pressured the resources under pressure
+ */
+void scale_for_pressure ( Server manager[], unsigned pressured ){
+  double now = now_seconds();
+  int k;
+  for ( k = 0; k < MAX_SERVERS; ++k){
+    Server* server = &manager[k];
+    if ( server->name == NULL || server->state != SERVER_RUNNING ||
+         server->handshake != HANDSHAKE_DONE){
+      continue;
+    }
+    if ( pressured && server->active_processes > server->min_process &&
+         now - server->scaled_at >= SCALE_DOWN_INTERVAL){
+      if ( signal_server(server, RETIRE_SIGNAL) < 0){
+        continue;
+      }
+      server->active_processes--;
+      server->scaled_at = now;
+    } else if ( !pressured && server->deferred > 0 &&
+                now - server->scaled_at >= DEFERRED_RELEASE_INTERVAL){
+      if ( signal_server(server, SIGUSR2) < 0){
+        continue;
+      }
+      server->active_processes++;
+      server->deferred--;
+      server->scaled_at = now;
+    }
+  }
+}
+
+/**
+ * Returns how long the event loop may sleep before scaling again
+ * @param manager the server manager
+ * @param pressured the resources under pressure
+ * @return the timeout in milliseconds, -1 if nothing is left to scale
+ */
+int next_scale_timeout ( Server manager[], unsigned pressured ){
+  double now = now_seconds(), next = -1;
+  int k;
+  for ( k = 0; k < MAX_SERVERS; ++k){
+    Server* server = &manager[k];
+    if ( server->name == NULL || server->state != SERVER_RUNNING ||
+         server->handshake != HANDSHAKE_DONE){ // Its control socket wakes us
+      continue;
+    }
+    double at = -1;
+    if ( pressured && server->active_processes > server->min_process){
+      at = server->scaled_at + SCALE_DOWN_INTERVAL;
+    } else if ( !pressured && server->deferred > 0){
+      at = server->scaled_at + DEFERRED_RELEASE_INTERVAL;
+    }
+    if ( at >= 0 && (next < 0 || at < next)){
+      next = at;
+    }
+  }
+  if ( next < 0){
+    return -1;
+  }
+  return next <= now ? 0 : (int) ((next - now) * 1000) + 1;
+}
+
+/**
+ * Returns the shorter of two poll timeouts, where -1 waits forever
+ */
+int min_timeout ( int a, int b ){
+  if ( a < 0){
+    return b;
+  }
+  return b < 0 || a < b ? a : b;
+}
+
+/**
+ * Parses a time of day written as HH:MM
+ * @param text the time
+ * @param hour receives the hour
+ * @param minute receives the minute
+ * @return 0 on success, -1 if it is not a time of day
+ */
+int parse_time_of_day ( const char* text, int* hour, int* minute ){
+  char rest;
+  if ( sscanf(text, "%d:%d%c", hour, minute, &rest) != 2 ||
+       *hour < 0 || *hour > 23 || *minute < 0 || *minute > 59){
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Returns the tick a rule is due on next, on the wheel's clock
+ * The wall clock is only read here, so a rule follows daylight saving
+ * and clock changes from the next time it is placed.
+ * @param rule the rule
+ * @param after the wall clock time it must be due after
+ * @return the tick
+ */
+uint64_t next_rule_tick ( const ScaleRule* rule, time_t after ){
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  struct tm at;
+  localtime_r(&after, &at);
+  at.tm_hour = rule->hour;
+  at.tm_min = rule->minute;
+  at.tm_sec = 0;
+  at.tm_isdst = -1;
+  time_t due = mktime(&at);
+  if ( due <= after){ // Tomorrow, mktime carries the day over
+    localtime_r(&after, &at);
+    at.tm_mday++;
+    at.tm_hour = rule->hour;
+    at.tm_min = rule->minute;
+    at.tm_sec = 0;
+    at.tm_isdst = -1;
+    due = mktime(&at);
+  }
+  // Rounded up, so it is never applied before its minute
+  double delay = due - now.tv_sec - now.tv_nsec / 1e9;
+  double when = now_seconds() + (delay > 0 ? delay : 0);
+  uint64_t tick = (uint64_t) when;
+  return tick < when ? tick + 1 : tick;
+}
+
+/**
+ * Adds a daily rule setting a server's minimum
+ * As in "scheduleScale web 08:55 40", which starts replicas up to 40 at
+ * 08:55 so they are warm when the morning peak arrives; a later rule
+ * with a lower minimum retires them again.
+ * @param tokens the scheduleScale command: name HH:MM min [max]
+ * @return 0 on success, -1 on error
+ */
+int add_scale_rule ( char* tokens[] ){
+  int hour, minute;
+  if ( tokens[2] == NULL || tokens[3] == NULL || tokens[4] == NULL ||
+       parse_time_of_day(tokens[3], &hour, &minute) < 0){
+    fprintf(stderr, "Usage: scheduleScale name HH:MM min [max]\n");
+    return -1;
+  }
+  int min = atoi(tokens[4]), max = tokens[5] != NULL ? atoi(tokens[5]) : 0;
+  if ( min < 1 || (tokens[5] != NULL && max < min) || max > MAX_REPLICAS){
+    fprintf(stderr, "ERROR: scheduled limits must be 1 <= min <= max <= %d\n",
+            MAX_REPLICAS);
+    return -1;
+  }
+
+  ScaleRule* rule = calloc(1, sizeof(ScaleRule));
+  if ( rule == NULL){
+    return -1;
+  }
+  rule->server = strdup(tokens[2]);
+  rule->hour = hour;
+  rule->minute = minute;
+  rule->min = min;
+  rule->max = max;
+  rule->next = scale_rules;
+  scale_rules = rule;
+  wheel_add(&schedule, &rule->timer, next_rule_tick(rule, time(NULL)));
+  return 0;
+}
+
+/**
+ * Removes the rules of a server, or only the one due at a time of day
+ * @param name the server's name
+ * @param at the time of day as HH:MM, NULL for all of its rules
+ * @return 0 if any rule was removed, -1 otherwise
+ */
+int remove_scale_rules ( const char* name, const char* at ){
+  int hour = -1, minute = -1, removed = 0;
+  if ( at != NULL && parse_time_of_day(at, &hour, &minute) < 0){
+    fprintf(stderr, "Usage: unscheduleScale name [HH:MM]\n");
+    return -1;
+  }
+  ScaleRule** link = &scale_rules;
+  while ( *link != NULL){
+    ScaleRule* rule = *link;
+    if ( strcmp(rule->server, name) != 0 ||
+         (at != NULL && (rule->hour != hour || rule->minute != minute))){
+      link = &rule->next;
+      continue;
+    }
+    *link = rule->next;
+    wheel_remove(&schedule, &rule->timer);
+    free(rule->server);
+    free(rule);
+    removed++;
+  }
+  if ( removed == 0){
+    fprintf(stderr, "ERROR: no scheduled scaling of %s\n", name);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Applies a rule to its server, raising or lowering its minimum
+ * Replicas missing to reach a higher minimum are deferred, so they start
+ * one at a time and still wait out host pressure. Lowering the minimum
+ * retires the replicas above it. Neither goes past the maximum.
+ * @param rule the rule
+ * @param manager the server manager
+ */
+void apply_scale_rule ( const ScaleRule* rule, Server manager[] ){
+  Server* server = find_server(rule->server, manager);
+  if ( server == NULL || server->state == SERVER_QUARANTINED){
+    return;
+  }
+  bool lowered = rule->min < server->min_process;
+  if ( rule->max > 0){
+    server->max_process = rule->max;
+  }
+  server->min_process = rule->min < server->max_process ? rule->min
+                                                        : server->max_process;
+
+  int total = server->active_processes + server->deferred;
+  int target = total < server->min_process || lowered ? server->min_process
+                                                      : total;
+  if ( target > server->max_process){
+    target = server->max_process;
+  }
+  if ( target > total && server->state == SERVER_BACKOFF){
+    server->active_processes += target - total; // Its respawn starts them all
+  } else if ( target > total){
+    server->deferred += target - total;
+  }
+  for ( ; total > target; --total){
+    if ( server->deferred > 0){
+      server->deferred--;
+    } else if ( server->state == SERVER_BACKOFF){
+      server->active_processes--;
+    } else if ( signal_server(server, RETIRE_SIGNAL) == 0){ // Queued
+      server->active_processes--;
+      server->scaled_at = now_seconds();
+    } else {
+      break;
+    }
+  }
+  eventlog_emit(LOG_INFO, EV_SCALE_SCHEDULED, server->name,
+                server->min_process, target);
+}
+
+/**
+ * Sets a server's limits right away, as a rule due now would
+ * As in "scaleServer web 10", which brings web to at least 10 replicas
+ * or retires those above 10, whichever it takes.
+ * @param tokens the scaleServer command: name min [max]
+ * @param manager the server manager
+ * @return 0 on success, -1 on error
+ */
+int scale_server ( char* tokens[], Server manager[] ){
+  if ( tokens[2] == NULL || tokens[3] == NULL){
+    fprintf(stderr, "Usage: scaleServer name min [max]\n");
+    return -1;
+  }
+  ScaleRule rule = { .server = tokens[2], .min = atoi(tokens[3]),
+                     .max = tokens[4] != NULL ? atoi(tokens[4]) : 0 };
+  if ( rule.min < 1 || (tokens[4] != NULL && rule.max < rule.min) ||
+       rule.max > MAX_REPLICAS){
+    fprintf(stderr, "ERROR: limits must be 1 <= min <= max <= %d\n",
+            MAX_REPLICAS);
+    return -1;
+  }
+  Server* server = find_server(rule.server, manager);
+  if ( server == NULL){
+    fprintf(stderr, "ERROR: no server found under name %s\n", rule.server);
+    return -1;
+  } else if ( server->state == SERVER_QUARANTINED){
+    printf("Sorry, server %s is quarantined\n", rule.server);
+    return -1;
+  }
+  apply_scale_rule(&rule, manager);
+  return 0;
+}
+
+/**
+ * Applies the rules that came due, and places them for the next day
+ * @param manager the server manager
+ */
+void run_scale_rules ( Server manager[] ){
+  Timer* timer = wheel_advance(&schedule, (uint64_t) now_seconds());
+  while ( timer != NULL){
+    ScaleRule* rule = (ScaleRule*) timer;
+    timer = timer->next;
+    apply_scale_rule(rule, manager);
+    // A minute on, in case the wheel ran ahead of the wall clock
+    wheel_add(&schedule, &rule->timer, next_rule_tick(rule, time(NULL) + 60));
+  }
+}
+
+/**
+ * Returns how long the event loop may sleep before a rule is due
+ * @return the timeout in milliseconds, -1 if there is no rule
+ */
+int next_rule_timeout (){
+  long ticks = wheel_next(&schedule);
+  if ( ticks < 0){
+    return -1;
+  }
+  double at = schedule.now + ticks, now = now_seconds();
+  return at <= now ? 0 : (int) ((at - now) * 1000) + 1;
+}
+
+/**
+ * Displays every rule and when it is due next
+ */
+void display_schedule (){
+  ScaleRule* rule;
+  for ( rule = scale_rules; rule != NULL; rule = rule->next){
+    printf("[Server Manager]: %s at %02d:%02d min=%d", rule->server,
+           rule->hour, rule->minute, rule->min);
+    if ( rule->max > 0){
+      printf(" max=%d", rule->max);
+    }
+    uint64_t now = (uint64_t) now_seconds();
+    printf(" due_in=%llus\n", (unsigned long long)
+           (rule->timer.expires > now ? rule->timer.expires - now : 0));
+  }
+}
+
 /**
  * Displays a prompt for the user to input commands
 */
@@ -69,16 +838,142 @@ void display_prompt(){
 
 /**
  * Displays the current status of the system
+ * @param manager the server manager
  */
-void display_status(){
+void display_status( Server manager[] ){
   
+  // posix_spawn does not copy our page tables, unlike fork
   int status;
-  pid_t pid = fork();
-  if (pid == 0){
-    char* command[] = {"/bin/bash", "-c", "ps f", NULL};
-    execvp(command[0], command);
-  } else {
-    wait(&status);
+  pid_t pid;
+  char* command[] = {"/bin/bash", "-c", "ps f", NULL};
+  posix_spawnattr_t attr;
+  sigset_t none, pipe;
+  sigemptyset(&none);
+  sigemptyset(&pipe);
+  sigaddset(&pipe, SIGPIPE); // Ignored by us for the agent's sake
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setsigmask(&attr, &none);
+  posix_spawnattr_setsigdefault(&attr, &pipe);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+  if ( posix_spawn(&pid, command[0], NULL, &attr, command, environ) == 0){
+    waitpid(pid, &status, 0);
+  }
+  posix_spawnattr_destroy(&attr);
+  display_health(manager);
+  display_latency(manager);
+  display_memory(manager);
+}
+
+/**
+ * Displays the shared and private memory of every replica
+ * Replicas forked from a zygote should be mostly shared.
+ * Thread-mode replicas live in the server, which is shown instead.
+ * @param manager the server manager
+ */
+void display_memory( Server manager[] ){
+  int k, i;
+  for ( k = 0; k < MAX_SERVERS; ++k) {
+    const ServerStats* stats = manager[k].stats;
+    if ( manager[k].name == NULL || stats == NULL) {
+      continue;
+    }
+    if ( stats->thread_mode) {
+      long shared, private;
+      if ( read_proc_memory(manager[k].server_pid, &shared, &private) == 0) {
+        printf("[Server Manager]: %s threads=%d shared=%ldKB private=%ldKB\n",
+               manager[k].name, stats_live_replicas(stats), shared / 1024,
+               private / 1024);
+      }
+      continue;
+    }
+    for ( i = 0; i < stats_slots(stats); ++i) {
+      pid_t replica = stats->replicas[i].pid;
+      long shared, private;
+      if ( replica == 0 || read_proc_memory(replica, &shared, &private) < 0) {
+        continue;
+      }
+      printf("[Server Manager]: %s replica %d shared=%ldKB private=%ldKB\n",
+             manager[k].name, (int) replica, shared / 1024, private / 1024);
+    }
+  }
+}
+
+/**
+ * Displays the state and crash history of every server
+ * @param manager the server manager
+ */
+void display_health( Server manager[] ){
+  const char* states[] = {"running", "backoff", "quarantined"};
+  double now = now_seconds();
+  int k;
+  for ( k = 0; k < MAX_SERVERS; ++k) {
+    Server* server = &manager[k];
+    if ( server->name == NULL) {
+      continue;
+    }
+    printf("[Server Manager]: %s state=%s pid=%d crashes=%lu restarts=%lu "
+           "replicas=%d/%d-%d qos=%s", server->name, states[server->state],
+           server->server_pid, server->crashes, server->restarts,
+           server->active_processes, server->min_process, server->max_process,
+           qos_name(server->qos));
+    if ( server->deferred > 0) {
+      printf(" deferred=%d", server->deferred);
+    }
+    if ( server->state == SERVER_BACKOFF) {
+      printf(" respawn_in=%.1fs", server->respawn_at - now);
+    } else if ( server->state == SERVER_QUARANTINED) {
+      printf(" (resumeServer %s to retry)", server->name);
+    }
+    printf("\n");
+  }
+}
+
+/**
+ * Displays the state of every server and the totals of this node
+ * The last line is what fleetStatus adds up across nodes.
+ * @param manager the server manager
+ */
+void display_node ( Server manager[] ){
+  int k, replicas = 0, deferred = 0;
+  display_health(manager);
+  for ( k = 0; k < MAX_SERVERS; ++k){
+    if ( manager[k].name != NULL){
+      replicas += manager[k].active_processes;
+      deferred += manager[k].deferred;
+    }
+  }
+  printf("[Server Manager]: servers=%d replicas=%d deferred=%d pressure=%u\n",
+         server_count, replicas, deferred, pressured);
+}
+
+/**
+ * Displays the latency percentiles and jobs in flight of every server
+ * The replicas' histograms are only merged here, recording costs them
+ * no system call.
+ * @param manager the server manager
+ */
+void display_latency( Server manager[] ){
+  static Histogram merged;
+  int k;
+  for ( k = 0; k < MAX_SERVERS; ++k) {
+    if ( manager[k].name == NULL || manager[k].stats == NULL) {
+      continue;
+    }
+    memset(&merged, 0, sizeof(merged));
+    stats_merge_latency(manager[k].stats, &merged);
+    ServerLoad load;
+    stats_load(manager[k].stats, &load);
+    printf("[Server Manager]: %s jobs=%llu in_flight=%u peak=%u cap=%u "
+           "queued=%u/%u rejected=%llu shed=%llu overloaded=%u "
+           "p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n", manager[k].name,
+           (unsigned long long) merged.total, load.in_flight, load.peak,
+           manager[k].stats->concurrency, load.queued,
+           manager[k].stats->queue_limit, (unsigned long long) load.rejected,
+           (unsigned long long) load.shed, load.overloaded,
+           hist_percentile(&merged, 50.0) / 1000.0,
+           hist_percentile(&merged, 99.0) / 1000.0,
+           hist_percentile(&merged, 99.9) / 1000.0,
+           merged.max / 1000.0);
   }
 }
 /**
@@ -89,8 +984,9 @@ void display_status(){
  * @return -1 if there's an error, 1 if no command was entered, 0 otherwise.
  */
 int read_command(char* tokens[]) {
-    int max_size = STR_BUFFER_SIZE * MAX_ARGS;
-    char* command_buffer = malloc(max_size);
+    // Tokens point into this buffer, so it must outlive the command
+    static char command_buffer[STR_BUFFER_SIZE * MAX_ARGS];
+    int max_size = sizeof(command_buffer);
     if (fgets(command_buffer, max_size, stdin) == NULL) {
         fprintf(stderr, "There was an error reading user input.\n");
         return -1;
@@ -130,34 +1026,59 @@ int parse_command(char* command_buffer, char* tokens[]) {
             return -1;
         }
     }
-    free(command_buffer);
+    // The tokens double as the server's argv. Clearing the rest keeps a
+    // longer command's tokens from showing through a shorter one's.
+    for (; count < MAX_ARGS; ++count) {
+        tokens[count] = NULL;
+    }
     return 0;
 }
 
 /**
- * Searches for the server's pid before sending a kill signal.
+ * Finds the struct of the server with the given name
+ * @return the struct, NULL if no server has that name
  */
-pid_t search_server ( const char* name, Server manager[] ){
+Server* find_server ( const char* name, Server manager[] ){
   int k;
-  pid_t ts_pid;
   for ( k = 0; k < MAX_SERVERS; ++k) {
     if ( manager[k].name != NULL) { // Avoids comparing to null pointers.
-        if( strcmp(manager[k].name,name) == 0){
-          ts_pid = manager[k].server_pid;
-	  free(manager[k].name);
-          return ts_pid ;
+      if( strcmp(manager[k].name,name) == 0){
+        return &manager[k];
       }
     }
   }
-  return -1;
+  return NULL;
+}
+
+/**
+ * Finds an unused server struct
+ * @return the struct, NULL if the manager is full
+ */
+Server* free_slot ( Server manager[] ){
+  int k;
+  for ( k = 0; k < MAX_SERVERS; ++k) {
+    if ( manager[k].name == NULL) {
+      return &manager[k];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Searches for the server's pid before sending a kill signal.
+ */
+pid_t search_server ( const char* name, Server manager[] ){
+  Server* server = find_server(name, manager);
+  return server != NULL ? server->server_pid : -1;
 }
 
 /**
  * Creates a new process on the given server name 
+ * The replica only counts once the server was asked for it.
  * @param name is the name of the server
  * @param manager the server manager
- * @return pid if we are not exceeding the limits 
- * 0 if we are passing the limit 
+ * @return pid of the server asked for one more replica
+ * 0 if we are passing the limit or the server is not up
  * -1 if the given server does not exist
  */
 pid_t create_process ( const char* name, Server manager[]){
@@ -168,7 +1089,11 @@ pid_t create_process ( const char* name, Server manager[]){
 	int max = manager[k].max_process;
 	int active = manager[k].active_processes;
         if( strcmp(manager[k].name,name) == 0){
-	  if ( active + 1 <= max){
+	  if ( manager[k].state != SERVER_RUNNING){
+	    return 0;
+	  }
+	  if ( active + manager[k].deferred + 1 <= max &&
+	       signal_server(&manager[k], SIGUSR2) == 0){
 	    ts_pid = manager[k].server_pid;
 	    manager[k].active_processes++;
             return ts_pid ;
@@ -180,6 +1105,769 @@ pid_t create_process ( const char* name, Server manager[]){
   }
   return -1;
 }
+
+/**
+ * Signals a running server once its instance is up
+ * Until then its pid is 0 while the spawn is pending, or -1 after a
+ * failed one, which kill() would take for our whole process group or
+ * every process we may signal.
+ * @param server the struct of the server
+ * @param sig the signal
+ * @return 0 if the signal was sent, -1 otherwise
+ */
+int signal_server ( Server* server, int sig ){
+  if ( server->state != SERVER_RUNNING || server->server_pid <= 0 ||
+       server->handshake != HANDSHAKE_DONE){
+    return -1;
+  }
+  return kill(server->server_pid, sig);
+}
+
+/**
+ * Aborts one copy of the given server name
+ * The server retires its newest replica once that finishes its jobs.
+ * A replica still deferred by host pressure is dropped first instead.
+ * @param name is the name of the server
+ * @param manager the server manager
+ * @return 1 if a replica was dropped or retired,
+ * 0 if the server is at its minimum, not running or still starting
+ * -1 if the given server does not exist
+ */
+int abort_process ( const char* name, Server manager[]){
+  Server* server = find_server(name, manager);
+  if ( server == NULL){
+    return -1;
+  }
+  if ( server->deferred > 0){
+    server->deferred--;
+    return 1;
+  }
+  if ( server->active_processes <= server->min_process ||
+       signal_server(server, RETIRE_SIGNAL) < 0){
+    return 0;
+  }
+  server->active_processes--;
+  server->scaled_at = now_seconds();
+  return 1;
+}
+
+/**
+ * Finds the node registered under a name
+ * @return its struct, NULL if there is none
+ */
+Node* find_node ( const char* name ){
+  int i;
+  for ( i = 0; i < MAX_NODES; ++i){
+    if ( nodes[i].name != NULL && strcmp(nodes[i].name, name) == 0){
+      return &nodes[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Registers the agent of another host under a name
+ * Nodes that cannot be reached yet are kept, and connected on first use.
+ * @param name the name of the node
+ * @param address the host:port of its agent
+ * @return 0 on success, -1 on error
+ */
+int add_node ( const char* name, const char* address ){
+  const char* colon = strrchr(address, ':');
+  Node* node = NULL;
+  int i;
+  for ( i = 0; i < MAX_NODES && node == NULL; ++i){
+    if ( nodes[i].name == NULL){
+      node = &nodes[i];
+    }
+  }
+  if ( colon == NULL || colon == address || colon[1] == '\0'){
+    fprintf(stderr, "ERROR: %s is not host:port\n", address);
+    return -1;
+  } else if ( find_node(name) != NULL){
+    fprintf(stderr, "ERROR: node %s already exists\n", name);
+    return -1;
+  } else if ( node == NULL){
+    fprintf(stderr, "ERROR: cannot manage more than %d nodes\n", MAX_NODES);
+    return -1;
+  }
+  node->name = strdup(name);
+  node->host = strndup(address, colon - address);
+  node->port = strdup(colon + 1);
+  node->fd = -1;
+  if ( node_connect(node) < 0){
+    printf("Node %s is unreachable for now, will retry on use\n", name);
+  }
+  return 0;
+}
+
+/**
+ * Forgets a node, the servers on it keep running
+ * @param node the node
+ */
+void remove_node ( Node* node ){
+  node_close(node);
+  free(node->name);
+  free(node->host);
+  free(node->port);
+  node->name = NULL;
+}
+
+/**
+ * Shows a line a node answered with, prefixed by the node's name
+ */
+void print_node_line ( Node* node, const char* line, void* ctx ){
+  printf("[%s] %s\n", node->name, line);
+}
+
+/**
+ * Sends the same batch to each of the given nodes, all before reading
+ * any reply, so the nodes work through it at the same time.
+ * @param targets "all" or a comma separated list of node names
+ * @param lines the commands, one per line
+ * @param count the number of commands
+ * @param fn receives every line the nodes answer with
+ * @param ctx passed to fn
+ * @param failed if not NULL, receives the number of commands that failed,
+ *        counting all of those sent to a node that did not answer
+ * @return the number of nodes that answered the whole batch
+ */
+int send_batch ( const char* targets, const char* lines, int count,
+                 NodeLineFn fn, void* ctx, int* failed ){
+  bool sent[MAX_NODES] = { false };
+  int i, answered = 0, lost = 0;
+  for ( i = 0; i < MAX_NODES; ++i){
+    if ( nodes[i].name == NULL){
+      continue;
+    }
+    if ( strcmp(targets, "all") != 0){
+      // Match whole names only within the comma separated list
+      size_t len = strlen(nodes[i].name);
+      const char* at = targets;
+      while ( (at = strstr(at, nodes[i].name)) != NULL &&
+              !((at == targets || at[-1] == ',') &&
+                (at[len] == ',' || at[len] == '\0'))){
+        at += len;
+      }
+      if ( at == NULL){
+        continue;
+      }
+    }
+    sent[i] = node_send(&nodes[i], lines, strlen(lines)) == 0;
+    if ( !sent[i]){
+      fprintf(stderr, "ERROR: node %s is unreachable\n", nodes[i].name);
+      lost += count;
+    }
+  }
+  for ( i = 0; i < MAX_NODES; ++i){
+    if ( !sent[i]){
+      continue;
+    }
+    int result = node_receive(&nodes[i], count, fn, ctx);
+    if ( result < 0){
+      fprintf(stderr, "ERROR: node %s did not answer\n", nodes[i].name);
+      lost += count;
+    } else {
+      lost += result;
+      answered++;
+    }
+  }
+  if ( failed != NULL){
+    *failed = lost;
+  }
+  return answered;
+}
+
+/**
+ * Runs a batch of commands on some nodes, showing every node's output
+ * Commands are separated by ";", as in
+ * "onNode all createServer web 2 4 8080 ; createProcess web".
+ * @param targets "all" or a comma separated list of node names
+ * @param tokens the commands' tokens, NULL terminated
+ * @return 0 if every command succeeded on a node, -1 otherwise
+ */
+int on_nodes ( const char* targets, char* tokens[] ){
+  char lines[AGENT_LINE_SIZE];
+  size_t len = 0;
+  int i, count = 0;
+  for ( i = 0; tokens[i] != NULL && len < sizeof(lines); ++i){
+    bool end = strcmp(tokens[i], ";") == 0;
+    if ( !end){
+      len += snprintf(lines + len, sizeof(lines) - len, "%s%s",
+                      len > 0 && lines[len - 1] != '\n' ? " " : "", tokens[i]);
+    }
+    if ( (end || tokens[i + 1] == NULL) && len > 0 && len < sizeof(lines) &&
+         lines[len - 1] != '\n'){
+      len += snprintf(lines + len, sizeof(lines) - len, "\n");
+      count++;
+    }
+  }
+  if ( count == 0 || len >= sizeof(lines)){
+    fprintf(stderr, "Usage: onNode all|name[,name] command [; command]\n");
+    return -1;
+  }
+  int failed;
+  int answered = send_batch(targets, lines, count, print_node_line, NULL,
+                            &failed);
+  return answered > 0 && failed == 0 ? 0 : -1;
+}
+
+// Totals of the fleet, added up from the nodes' summary lines
+typedef struct FleetTotals {
+  int servers;
+  int replicas;
+  int deferred;
+  int pressured;
+} FleetTotals;
+
+/**
+ * Shows a line of a node's status and adds its summary to the totals
+ */
+void add_node_status ( Node* node, const char* line, void* ctx ){
+  FleetTotals* totals = ctx;
+  int servers, replicas, deferred;
+  unsigned pressure;
+  if ( sscanf(line, "[Server Manager]: servers=%d replicas=%d deferred=%d "
+              "pressure=%u", &servers, &replicas, &deferred, &pressure) == 4){
+    totals->servers += servers;
+    totals->replicas += replicas;
+    totals->deferred += deferred;
+    totals->pressured += pressure != 0;
+  }
+  print_node_line(node, line, ctx);
+}
+
+/**
+ * Displays the status of every node and the totals of the fleet
+ */
+void display_fleet (){
+  FleetTotals totals = { 0, 0, 0, 0 };
+  int i, registered = 0;
+  for ( i = 0; i < MAX_NODES; ++i){
+    registered += nodes[i].name != NULL;
+  }
+  int answered = send_batch("all", "nodeStatus\n", 1, add_node_status,
+                            &totals, NULL);
+  printf("[Fleet]: nodes=%d/%d servers=%d replicas=%d deferred=%d "
+         "pressured=%d\n", answered, registered, totals.servers,
+         totals.replicas, totals.deferred, totals.pressured);
+}
+
+// The fewest arguments each command takes, checked before it runs
+static const struct {
+  const char* name;
+  int min_args;
+} command_arity[] = {
+  {"createServer", 3}, {"abortServer", 1}, {"restartServer", 1},
+  {"resumeServer", 1}, {"createProcess", 1}, {"abortProcess", 1},
+  {"addNode", 2}, {"removeNode", 1}, {"onNode", 2}, {"scaleServer", 2},
+  {"scheduleScale", 3}, {"unscheduleScale", 1}
+};
+
+/**
+ * Checks a command has the arguments it needs
+ * Commands not listed take none, or are reported unknown when run.
+ * @param tokens the tokenized command, NULL after the last
+ * @return 0 if it may run, -1 otherwise
+ */
+int check_arguments ( char* tokens[] ){
+  int i, args = 0;
+  while ( args < MAX_ARGS - 2 && tokens[args + 2] != NULL){
+    args++;
+  }
+  for ( i = 0; i < (int) (sizeof(command_arity) / sizeof(command_arity[0]));
+        ++i){
+    if ( strcmp(tokens[1], command_arity[i].name) == 0 &&
+         args < command_arity[i].min_args){
+      fprintf(stderr, "ERROR: %s takes at least %d arguments, %d given\n",
+              tokens[1], command_arity[i].min_args, args);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Runs one command and records how long it took
+ * @param tokens the tokenized command, tokens[0] is the server executable
+ * @param manager the server manager
+ * @return the status of the command, 0 on success, -1 on error
+ */
+int run_command ( char* tokens[], Server manager[] ){
+  if ( check_arguments(tokens) < 0){
+    return -1;
+  }
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int status = execute_command(tokens, manager);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  hist_record(&command_latency, (end.tv_sec - start.tv_sec) * 1000000000ULL
+                                + end.tv_nsec - start.tv_nsec);
+  return status;
+}
+
+/**
+ * Runs a command line read by the agent, its output going to the client
+ * stdout and stderr point at the connection while the command runs, so
+ * it answers exactly what it would print at the prompt.
+ * @param line the command line
+ * @param client_fd the connection it came from
+ * @param hang_up set for quit, which only ends the session
+ * @param ctx the server manager
+ * @return the status of the command, -1 if it could not be parsed
+ */
+int run_agent_command ( char* line, int client_fd, bool* hang_up,
+                        void* ctx ){
+  char* tokens[MAX_ARGS] = { "./server.o" };
+  fflush(stdout);
+  fflush(stderr);
+  int saved_out = dup(STDOUT_FILENO), saved_err = dup(STDERR_FILENO);
+  dup2(client_fd, STDOUT_FILENO);
+  dup2(client_fd, STDERR_FILENO);
+
+  int result = parse_command(line, tokens), status = result < 0 ? -1 : 0;
+  *hang_up = result == 0 && strcmp(tokens[1], "quit") == 0;
+  if ( result == 0 && !*hang_up){
+    status = run_command(tokens, ctx);
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+  dup2(saved_out, STDOUT_FILENO);
+  dup2(saved_err, STDERR_FILENO);
+  close(saved_out);
+  close(saved_err);
+  return status;
+}
+
+/**
+ * Executes one command entered by the user
+ * @param tokens the tokenized command, tokens[0] is the server executable
+ * @param manager the server manager
+ * @return 0 on success, -1 when the command failed or was not understood
+ */
+int execute_command ( char* tokens[], Server manager[] ){
+  int proc_limits[2];
+  pid_t pid;
+  // A missing name matches no server, rather than crashing the lookup
+  const char* name = tokens[2] != NULL ? tokens[2] : "";
+
+  if ( strcmp (tokens[1], "createServer") == 0){
+
+    Server* server = free_slot(manager);
+    if ( tokens[2] == NULL || tokens[3] == NULL || tokens[4] == NULL){
+      fprintf(stderr, "Usage: createServer name min max [port] "
+              "[zygote=1] [config=path] [mode=thread] "
+              "[concurrency=N] [queue=N] [overload=queue|shed|reject] "
+              "[queue_timeout=ms] [qos=critical|standard|batch|idle] "
+              "[cpus=list]\n");
+      return -1;
+    } else if ( server == NULL){
+      fprintf(stderr, "ERROR: cannot manage more than %d servers\n",
+              MAX_SERVERS);
+      return -1;
+    }
+
+    // Assign arguments for the struct of the given server.
+    proc_limits[0] = atoi(tokens[3]);
+    proc_limits[1] = atoi(tokens[4]);
+
+    // Create the server and update its struct
+    fill_struct(server, name, proc_limits);
+    pid = store_options(server, tokens) < 0 ? -1
+                                            : create_server(server, tokens);
+    if ( pid < 0){ // Nothing was started, so there is nothing to track
+      release_struct(server);
+      return -1;
+    }
+    update_struct(server,&pid);
+    server->started_at = now_seconds();
+    server_count++;
+    counters.servers_created++;
+    eventlog_emit(LOG_INFO, EV_SERVER_CREATED, name, server->spawn_id,
+                  proc_limits[0]);
+
+  } else if ( strcmp(tokens[1], "abortServer") == 0){
+    // Search for server to send a kill signal.
+    Server* server = find_server(name, manager);
+    if ( server == NULL){
+      fprintf(stderr, "ERROR: no server found under name %s\n", name);
+      return -1;
+    } else { // Send the signal for the server to shut down.
+
+      // Decrement the number of servers in the pool.
+      server_count--;
+      counters.servers_aborted++;
+      // Its exit is reported later by the spawner, for a struct long gone
+      if ( server->server_pid > 0){ // Nothing to stop in backoff or quarantine
+        kill(server->server_pid, SIGUSR1);
+      }
+      if ( server->retiring_pid > 0){
+        kill(server->retiring_pid, SIGUSR1);
+      }
+      eventlog_emit(LOG_INFO, EV_SERVER_ABORTED, name, server->server_pid,
+                    SIGUSR1);
+      release_struct(server);
+
+    }
+  } else if ( strcmp(tokens[1], "restartServer") == 0){
+    Server* server = find_server(name, manager);
+    if ( server == NULL){
+      fprintf(stderr, "ERROR: no server found under name %s\n", name);
+      return -1;
+    } else if ( restart_server(server) < 0){
+      fprintf(stderr, "ERROR: could not restart server %s\n", name);
+      return -1;
+    } else {
+      server->restarts++;
+    }
+  } else if ( strcmp(tokens[1], "resumeServer") == 0){
+    Server* server = find_server(name, manager);
+    if ( server == NULL){
+      fprintf(stderr, "ERROR: no server found under name %s\n", name);
+      return -1;
+    } else if ( server->state != SERVER_QUARANTINED){
+      printf("Server %s is not quarantined\n", name);
+      return -1;
+    } else {
+      // Forget the crash history, the operator vouches for the server
+      memset(server->crash_times, 0, sizeof(server->crash_times));
+      server->backoff_level = 0;
+      if ( respawn_server(server) < 0){
+        server->started_at = now_seconds();
+        server_exited(server, -1);
+      } else {
+        eventlog_emit(LOG_INFO, EV_SERVER_RESUMED, name, server->spawn_id, 0);
+      }
+    }
+  } else if ( strcmp(tokens[1], "quit") == 0){
+    exit(0);
+  } else if ( strcmp(tokens[1], "displayStatus") == 0){
+    display_status(manager);
+  } else if ( strcmp(tokens[1], "nodeStatus") == 0){
+    display_node(manager);
+  } else if ( strcmp(tokens[1], "fleetStatus") == 0){
+    display_fleet();
+  } else if ( strcmp(tokens[1], "addNode") == 0){
+    if ( tokens[2] == NULL || tokens[3] == NULL){
+      fprintf(stderr, "Usage: addNode name host:port\n");
+      return -1;
+    }
+    return add_node(tokens[2], tokens[3]);
+  } else if ( strcmp(tokens[1], "removeNode") == 0){
+    Node* node = tokens[2] != NULL ? find_node(tokens[2]) : NULL;
+    if ( node == NULL){
+      fprintf(stderr, "ERROR: no node found under name %s\n", name);
+      return -1;
+    } else {
+      remove_node(node);
+    }
+  } else if ( strcmp(tokens[1], "onNode") == 0){
+    if ( tokens[2] == NULL || tokens[3] == NULL){
+      fprintf(stderr, "Usage: onNode all|name[,name] command [; command]\n");
+      return -1;
+    }
+    return on_nodes(tokens[2], &tokens[3]);
+  }
+  else if ( strcmp(tokens[1], "scaleServer") == 0){
+    return scale_server(tokens, manager);
+  } else if ( strcmp(tokens[1], "scheduleScale") == 0){
+    return add_scale_rule(tokens);
+  } else if ( strcmp(tokens[1], "unscheduleScale") == 0){
+    if ( tokens[2] == NULL){
+      fprintf(stderr, "Usage: unscheduleScale name [HH:MM]\n");
+      return -1;
+    }
+    return remove_scale_rules(name, tokens[3]);
+  } else if ( strcmp(tokens[1], "displaySchedule") == 0){
+    display_schedule();
+  }
+  else if ( strcmp(tokens[1], "createProcess") == 0){
+    // Replicas wait for host pressure to clear, or for a server still
+    // starting to come up, as one sent in the same batch may be
+    Server* server = find_server(name, manager);
+    if ( server != NULL && server->state == SERVER_RUNNING &&
+         (pressured || server->handshake != HANDSHAKE_DONE) &&
+         server->active_processes + server->deferred < server->max_process){
+      server->deferred++;
+      if ( pressured){
+        eventlog_emit(LOG_WARN, EV_REPLICA_DEFERRED, name, server->deferred,
+                      server->active_processes);
+        printf("Host under pressure, replica of %s deferred until it clears\n",
+               name);
+      }
+      return 0;
+    }
+
+    // Search for the server that will create a process
+    int target_server_pid = (create_process(name, manager));
+    if ( target_server_pid < 0){
+      fprintf(stderr, "ERROR: no server found under name %s\n", name);
+      return -1;
+    } else if ( target_server_pid == 0){
+      printf("Sorry, server %s is at full capacity or not running\n", name);
+      return -1;
+    }
+  } else if ( strcmp(tokens[1], "abortProcess") == 0){
+    int result = abort_process(name, manager);
+    if ( result < 0){
+      fprintf(stderr, "ERROR: no server found under name %s\n", name);
+      return -1;
+    } else if ( result == 0){
+      printf("Sorry, server %s is at its minimum, not running or starting\n",
+             name);
+      return -1;
+    }
+  } else {
+    fprintf(stderr, "ERROR: unknown command %s\n", tokens[1]);
+    return -1;
+  }
+  return 0;
+}
+
+// What a server and its replicas use, gathered once per scrape
+typedef struct ServerUsage {
+  double cpu;                          // Seconds of CPU time
+  long rss;                            // Bytes resident
+  long shared;                         // Bytes shared, across replicas
+  long private;                        // Bytes private to the replicas
+  ServerLoad load;
+} ServerUsage;
+
+// What a server was last found to use in /proc, reread at most every
+// USAGE_INTERVAL seconds however often it is scraped
+#define USAGE_INTERVAL 5.0
+typedef struct UsageCache {
+  pid_t server_pid;                    // 0 until read, or the slot's reused
+  double read_at;
+  ServerUsage usage;
+} UsageCache;
+
+UsageCache usage_cache[MAX_SERVERS];
+
+// The per-server metric families, in the order they are rendered
+enum {
+  METRIC_REPLICAS, METRIC_SPAWNS, METRIC_EXITS, METRIC_RESTARTS,
+  METRIC_CRASHES, METRIC_QUARANTINED, METRIC_CPU, METRIC_RESIDENT,
+  METRIC_SHARED, METRIC_PRIVATE, METRIC_IN_FLIGHT, METRIC_QUEUED,
+  METRIC_REJECTED, METRIC_SHED, METRIC_OVERLOADED, METRIC_DEFERRED
+};
+
+typedef struct MetricFamily {
+  const char* name;
+  const char* type;
+  const char* help;
+  bool needs_stats;                    // Skipped for servers not yet up
+} MetricFamily;
+
+/**
+ * Reads what a server and its replicas use from /proc
+ * Thread-mode replicas are the server's own threads, so the server's
+ * entries already cover them and reading theirs would count it again.
+ * @param server the server
+ * @param usage receives the totals, zero for what could not be read
+ */
+static void gather_usage ( const Server* server, ServerUsage* usage ){
+  const ServerStats* stats = server->stats;
+  double cpu;
+  long rss, shared, private;
+  int i;
+  memset(usage, 0, sizeof(ServerUsage));
+
+  if ( read_proc_usage(server->server_pid, &cpu, &rss) == 0){
+    usage->cpu += cpu;
+    usage->rss += rss;
+  }
+  if ( stats == NULL){
+    return;
+  }
+  if ( stats->thread_mode){
+    if ( read_proc_memory(server->server_pid, &shared, &private) == 0){
+      usage->shared += shared;
+      usage->private += private;
+    }
+    return;
+  }
+  for ( i = 0; i < stats_slots(stats); ++i){
+    pid_t replica = stats->replicas[i].pid;
+    if ( replica == 0){
+      continue;
+    }
+    if ( read_proc_usage(replica, &cpu, &rss) == 0){
+      usage->cpu += cpu;
+      usage->rss += rss;
+    }
+    if ( read_proc_memory(replica, &shared, &private) == 0){
+      usage->shared += shared;
+      usage->private += private;
+    }
+  }
+}
+
+/**
+ * Renders the metrics of the whole fleet in the Prometheus text format
+ * Everything comes from counters kept in memory and the statistics the
+ * servers share, only CPU and memory are read from /proc, at most once
+ * per USAGE_INTERVAL.
+ * @param buf the buffer to render into
+ * @param manager the server manager
+ */
+void render_metrics ( MetricsBuffer* buf, Server manager[] ){
+  int k, i;
+  metrics_reset(buf);
+
+  metrics_family(buf, "scs_servers", "gauge", "Servers currently managed.");
+  metrics_printf(buf, "scs_servers %d\n", server_count);
+  metrics_family(buf, "scs_servers_created_total", "counter",
+                 "Servers created by the manager.");
+  metrics_printf(buf, "scs_servers_created_total %lu\n",
+                 counters.servers_created);
+  metrics_family(buf, "scs_servers_aborted_total", "counter",
+                 "Servers aborted by the manager.");
+  metrics_printf(buf, "scs_servers_aborted_total %lu\n",
+                 counters.servers_aborted);
+
+  metrics_family(buf, "scs_command_duration_seconds", "summary",
+                 "Time the manager took to execute a command.");
+  const double quantiles[] = {0.5, 0.99, 0.999};
+  for ( i = 0; i < 3; ++i){
+    metrics_printf(buf, "scs_command_duration_seconds{quantile=\"%g\"} %.9f\n",
+                   quantiles[i],
+                   hist_percentile(&command_latency, quantiles[i] * 100) / 1e9);
+  }
+  metrics_printf(buf, "scs_command_duration_seconds_sum %.9f\n",
+                 command_latency.sum / 1e9);
+  metrics_printf(buf, "scs_command_duration_seconds_count %llu\n",
+                 (unsigned long long) command_latency.total);
+
+  metrics_family(buf, "scs_host_pressure", "gauge",
+                 "Whether tasks stall on a resource past the PSI threshold.");
+  for ( i = 0; i < PRESSURE_NUM_RESOURCES; ++i){
+    metrics_printf(buf, "scs_host_pressure{resource=\"%s\"} %d\n",
+                   pressure_name(i), (pressured >> i) & 1);
+  }
+
+  // Read every server's shared load once per scrape, whichever families
+  // it ends up in, and its /proc entries once per USAGE_INTERVAL
+  ServerUsage usage[MAX_SERVERS];
+  double now = now_seconds();
+  for ( k = 0; k < MAX_SERVERS; ++k){
+    if ( manager[k].name == NULL){
+      continue;
+    }
+    UsageCache* cache = &usage_cache[k];
+    if ( cache->server_pid != manager[k].server_pid ||
+         now - cache->read_at >= USAGE_INTERVAL){
+      gather_usage(&manager[k], &cache->usage);
+      cache->server_pid = manager[k].server_pid;
+      cache->read_at = now;
+    }
+    usage[k] = cache->usage;
+    if ( manager[k].stats != NULL){
+      stats_load(manager[k].stats, &usage[k].load);
+    }
+  }
+
+  // One family at a time, as the text format wants their samples together
+  const MetricFamily families[] = {
+    {"scs_replicas", "gauge", "Replicas currently running.", true},
+    {"scs_replica_spawns_total", "counter", "Replicas forked by the server.",
+     true},
+    {"scs_replica_exits_total", "counter", "Replicas reaped by the server.",
+     true},
+    {"scs_server_restarts_total", "counter", "Restarts of the server.", false},
+    {"scs_server_crashes_total", "counter", "Unexpected exits of the server.",
+     false},
+    {"scs_server_quarantined", "gauge", "Whether the server is crash-looping.",
+     false},
+    {"scs_server_cpu_seconds_total", "counter",
+     "CPU time of the server and its replicas.", false},
+    {"scs_server_resident_memory_bytes", "gauge",
+     "Resident memory of the server and its replicas.", false},
+    {"scs_server_shared_memory_bytes", "gauge",
+     "Memory the replicas share with the server or each other.", false},
+    {"scs_server_private_memory_bytes", "gauge",
+     "Memory private to the replicas.", false},
+    {"scs_jobs_in_flight", "gauge", "Jobs the replicas are running.", true},
+    {"scs_jobs_queued", "gauge", "Jobs waiting in the replicas' queues.", true},
+    {"scs_jobs_rejected_total", "counter", "Jobs turned away on overload.",
+     true},
+    {"scs_jobs_shed_total", "counter", "Queued jobs dropped on overload.",
+     true},
+    {"scs_replicas_overloaded", "gauge", "Replicas whose queue is full.", true},
+    {"scs_replicas_deferred", "gauge", "Replicas held back by host pressure.",
+     false}
+  };
+  int family, num_families = sizeof(families) / sizeof(families[0]);
+  for ( family = 0; family < num_families; ++family){
+    const MetricFamily* f = &families[family];
+    metrics_family(buf, f->name, f->type, f->help);
+    for ( k = 0; k < MAX_SERVERS; ++k){
+      Server* server = &manager[k];
+      const ServerStats* stats = server->stats;
+      const ServerUsage* u = &usage[k];
+      if ( server->name == NULL || (f->needs_stats && stats == NULL)){
+        continue;
+      }
+      metrics_printf(buf, "%s{server=\"", f->name);
+      metrics_label(buf, server->name);
+      metrics_printf(buf, "\"} ");
+
+      switch ( family){
+      case METRIC_REPLICAS:
+        metrics_printf(buf, "%d\n", stats_live_replicas(stats));
+        break;
+      case METRIC_SPAWNS:
+        metrics_printf(buf, "%llu\n",
+                       (unsigned long long) stats->replica_spawns);
+        break;
+      case METRIC_EXITS:
+        metrics_printf(buf, "%llu\n", (unsigned long long) stats->replica_exits);
+        break;
+      case METRIC_RESTARTS:
+        metrics_printf(buf, "%lu\n", server->restarts);
+        break;
+      case METRIC_CRASHES:
+        metrics_printf(buf, "%lu\n", server->crashes);
+        break;
+      case METRIC_QUARANTINED:
+        metrics_printf(buf, "%d\n", server->state == SERVER_QUARANTINED);
+        break;
+      case METRIC_CPU:
+        metrics_printf(buf, "%.2f\n", u->cpu);
+        break;
+      case METRIC_RESIDENT:
+        metrics_printf(buf, "%ld\n", u->rss);
+        break;
+      case METRIC_SHARED:
+        metrics_printf(buf, "%ld\n", u->shared);
+        break;
+      case METRIC_PRIVATE:
+        metrics_printf(buf, "%ld\n", u->private);
+        break;
+      case METRIC_IN_FLIGHT:
+        metrics_printf(buf, "%u\n", u->load.in_flight);
+        break;
+      case METRIC_QUEUED:
+        metrics_printf(buf, "%u\n", u->load.queued);
+        break;
+      case METRIC_REJECTED:
+        metrics_printf(buf, "%llu\n", (unsigned long long) u->load.rejected);
+        break;
+      case METRIC_SHED:
+        metrics_printf(buf, "%llu\n", (unsigned long long) u->load.shed);
+        break;
+      case METRIC_OVERLOADED:
+        metrics_printf(buf, "%u\n", u->load.overloaded);
+        break;
+      case METRIC_DEFERRED:
+        metrics_printf(buf, "%d\n", server->deferred);
+        break;
+      }
+    }
+  }
+}
+
 int main(int argc, char* argv[]){
   
   if (argc < 1){
@@ -187,86 +1875,208 @@ int main(int argc, char* argv[]){
     exit(0);
   }
 
-  printf("[Server Manager]: Started server manager\n" );
+  eventlog_init("manager");
+
+  // Start the spawner first, while the manager is as small as it gets.
+  // Servers it starts are reparented to us if it ever dies.
+  prctl(PR_SET_CHILD_SUBREAPER, 1);
+  spawner_pid = start_spawner(&spawner_fd);
+  if ( spawner_pid < 0){
+    fprintf(stderr, "[Server Manager]: Could not start the spawner\n");
+    exit(1);
+  }
+  eventlog_emit(LOG_INFO, EV_MANAGER_STARTED, NULL, spawner_pid, 0);
+
+  // Act as this host's agent when asked to, a controller hanging up while
+  // we answer must not take us down
+  signal(SIGPIPE, SIG_IGN);
+  int agent_fd = -1, i;
+  char* agent_env = getenv(AGENT_PORT_ENV);
+  if ( agent_env != NULL){
+    agent_fd = agent_listen(atoi(agent_env), getenv(AGENT_BIND_ENV));
+    if ( agent_fd < 0){
+      fprintf(stderr, "[Server Manager]: Agent unavailable on port %s\n",
+              agent_env);
+    }
+  }
+  for ( i = 0; i < MAX_AGENT_CLIENTS; ++i){
+    agent_clients[i].fd = -1;
+  }
   
   // Global variables for server and process limits
   Server manager[MAX_SERVERS];
-  int server_count = 0;
-  int proc_limits[2];
-  pid_t pid;
-  const char* name;
+  memset(manager, 0, sizeof(manager));
 
   // Arguments to be passed to child processes via vector pointer
-  char* server_args[MAX_ARGS];
-  int i;
-  for ( i = 0; i<4; ++i){
-    server_args[i] = malloc(sizeof(char));
+  char* server_args[MAX_ARGS] = { "./server.o" };
+
+  // Serve metrics on loopback unless the port is set to 0
+  char* port_env = getenv(METRICS_PORT_ENV);
+  int metrics_port = port_env != NULL ? atoi(port_env) : DEFAULT_METRICS_PORT;
+  int metrics_fd = open_metrics_listener(metrics_port);
+  if ( metrics_fd < 0 && metrics_port > 0){
+    fprintf(stderr, "[Server Manager]: Metrics unavailable on port %d\n",
+            metrics_port);
   }
-  server_args[0] = "./server.o";
-  
+  MetricsBuffer metrics = { NULL, 0, 0 };
+  MetricsClient metrics_clients[MAX_METRICS_CLIENTS];
+  memset(metrics_clients, 0, sizeof(metrics_clients));
+  for ( i = 0; i < MAX_METRICS_CLIENTS; ++i){
+    metrics_clients[i].fd = -1;
+  }
+
+  // Server exits are reaped by the loop in order, through IORING_OP_WAITID
+  // or a signalfd, so SIGCHLD itself stays blocked
+  sigset_t sigchld;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &sigchld, NULL);
+  int child_fd = child_watch_init(&child_watch);
+
+  // Without PSI the manager scales as told, whatever the host's state
+  if ( pressure_init(&pressure, now_seconds()) == 0){
+    fprintf(stderr, "[Server Manager]: Pressure stall information "
+            "unavailable, scaling without it\n");
+  }
+
+  wheel_init(&schedule, (uint64_t) now_seconds());
+
+  // Commands are read a byte at a time, so none hides from poll in stdio
+  setvbuf(stdin, NULL, _IONBF, 0);
+  struct pollfd pfds[4 + MAX_PRESSURE_TRIGGERS + 1 + MAX_AGENT_CLIENTS
+                    + MAX_METRICS_CLIENTS + MAX_SERVERS];
+  Server* polled[MAX_SERVERS];
+  int stdin_fd = STDIN_FILENO, k;
+
   // Keep waiting for user input for the next command
-     while (1) {
-       
-       display_prompt();
-       if (read_command(server_args) != 0) {
-           continue;
-       }
-       
-       if ( strcmp (server_args[1], "createServer") == 0){
-	 
-	 // Assign arguments for the struct of the given server.
-	 name = server_args[2];
-	 proc_limits[0] = atoi(server_args[3]);
-	 proc_limits[1] = atoi(server_args[4]);
-	 
-	 // Create the server and update its struct
-	 fill_struct(&manager[server_count], name, proc_limits);
-	 pid = create_server(server_args);
-	 update_struct(&manager[server_count],&pid);
-	 server_count++;
-	   
-       } else if ( strcmp(server_args[1], "abortServer") == 0){
-         name = server_args[2];
- 
-	 // Search for server to send a kill signal.
-	 int target_server_pid = (search_server(name, manager)); 
-	 if ( target_server_pid < 0){
-	   fprintf(stderr, "ERROR: no server found under name %s\n", name);
-	 } else { // Send the signal for the server to shut down.
-           
-	   // Decrement the number of servers in the pool.
-           server_count--;
-	   int status;
-	   kill(target_server_pid, SIGUSR1);
-	   waitpid(target_server_pid, &status, 0);
-	   printf("The return status of child was %d\n", status);
-
-	 }
-       } else if ( strcmp(server_args[1], "quit") == 0){
-	 exit(0);
-       } else if ( strcmp(server_args[1], "displayStatus") == 0){
-	 display_status();
-       }
-       else if ( strcmp(server_args[1], "createProcess") == 0){
-         name = server_args[2];
-	 
-	 // Search for the server that will create a process 
-	 int target_server_pid = (create_process(name, manager)); 
-	 if ( target_server_pid < 0){
-	   fprintf(stderr, "ERROR: no server found under name %s\n", name);
-	 } else if (target_server_pid > 0)  { // Send the signal for the server to shut down.
-           
-	   int status;
-	   kill(target_server_pid, SIGUSR2);
-	   wait(&status);
-
-	 } else {
-	   printf("Sorry, server %s is at full capacity\n", name);
-	 }
-       } else if ( strcmp(server_args[1], "abortProcess") == 0){
-         // Do stuff for abort process
-       } 
-	
-     }
-}
+  display_prompt();
+  while (1) {
+    fflush(stdout);
+    eventlog_flush();
+
+    // Fixed sources first, then the pressure triggers, the agent and its
+    // clients, the scrapers, and the control sockets of the servers,
+    // carrying their handshake and later their overload notices
+    int nfds = 4, waiting = 0;
+    pfds[0] = (struct pollfd) { .fd = stdin_fd, .events = POLLIN };
+    pfds[1] = (struct pollfd) { .fd = metrics_fd, .events = POLLIN };
+    pfds[2] = (struct pollfd) { .fd = child_fd, .events = POLLIN };
+    pfds[3] = (struct pollfd) { .fd = spawner_fd, .events = POLLIN };
+    nfds += pressure_poll_fds(&pressure, &pfds[4]);
+    int first_agent = nfds;
+    pfds[nfds++] = (struct pollfd) { .fd = agent_fd, .events = POLLIN };
+    for ( i = 0; i < MAX_AGENT_CLIENTS; ++i){
+      pfds[nfds++] = (struct pollfd) { .fd = agent_clients[i].fd,
+                                       .events = POLLIN };
+    }
+    int first_scraper = nfds;
+    for ( i = 0; i < MAX_METRICS_CLIENTS; ++i){
+      bool replying = metrics_clients[i].reply.len > 0;
+      pfds[nfds++] = (struct pollfd) { .fd = metrics_clients[i].fd,
+                                       .events = replying ? POLLOUT : POLLIN };
+    }
+    int first_server = nfds;
+    for ( k = 0; k < MAX_SERVERS; ++k){
+      if ( manager[k].name != NULL && manager[k].control_fd >= 0){
+        polled[waiting++] = &manager[k];
+        pfds[nfds++] = (struct pollfd) { .fd = manager[k].control_fd,
+                                         .events = POLLIN };
+      }
+    }
+    int timeout = min_timeout(next_respawn_timeout(manager),
+                              next_scale_timeout(manager, pressured));
+    timeout = min_timeout(timeout, next_rule_timeout());
+    if ( pressured){
+      timeout = min_timeout(timeout, pressure_timeout(&pressure,
+                                                      now_seconds()));
+    }
+    if ( poll(pfds, nfds, timeout) < 0){
+      continue;
+    }
+
+    // Scale down for as long as any trigger keeps firing
+    unsigned was_pressured = pressured;
+    pressured = pressure_check(&pressure, &pfds[4], now_seconds());
+    if ( pressured && !was_pressured){
+      eventlog_emit(LOG_WARN, EV_PRESSURE_RAISED, NULL, pressured,
+                    pressure.threshold);
+    } else if ( !pressured && was_pressured){
+      int deferred = 0;
+      for ( k = 0; k < MAX_SERVERS; ++k){
+        deferred += manager[k].name != NULL ? manager[k].deferred : 0;
+      }
+      eventlog_emit(LOG_INFO, EV_PRESSURE_CLEARED, NULL, was_pressured,
+                    deferred);
+    }
+
+    // A helper replaced while reaping hung up on the socket we polled,
+    // its successor's socket has nothing to read yet
+    pid_t polled_spawner = spawner_pid;
+    if ( pfds[2].revents & POLLIN){
+      reap_servers(manager);
+    }
+    if ( pfds[3].revents & (POLLIN | POLLHUP) && spawner_pid == polled_spawner){
+      handle_spawner(manager);
+    }
+    for ( k = 0; k < waiting; ++k){
+      if ( !(pfds[first_server + k].revents & (POLLIN | POLLHUP))){
+        continue;
+      }
+      if ( polled[k]->handshake != HANDSHAKE_DONE){
+        continue_handshake(polled[k]);
+      } else {
+        read_load_notices(polled[k]);
+      }
+    }
+    respawn_due(manager);
+    run_scale_rules(manager);
+    scale_for_pressure(manager, pressured);
 
+    // Commands from controllers run between the user's, never during one
+    for ( i = 0; i < MAX_AGENT_CLIENTS; ++i){
+      if ( pfds[first_agent + 1 + i].revents & (POLLIN | POLLHUP | POLLERR)){
+        agent_read(&agent_clients[i], run_agent_command, manager);
+      }
+    }
+    if ( pfds[first_agent].revents & POLLIN){
+      agent_accept(agent_fd, agent_clients);
+    }
+
+    // Scrapers that sent their request share one rendering, those still
+    // being answered get the rest once their socket has room
+    bool rendered = false;
+    for ( i = 0; i < MAX_METRICS_CLIENTS; ++i){
+      short revents = pfds[first_scraper + i].revents;
+      if ( metrics_clients[i].reply.len > 0){
+        if ( revents & (POLLOUT | POLLHUP | POLLERR)){
+          metrics_write(&metrics_clients[i]);
+        }
+        continue;
+      }
+      if ( !(revents & (POLLIN | POLLHUP | POLLERR)) ||
+           metrics_read(&metrics_clients[i]) <= 0){
+        continue;
+      }
+      if ( !rendered){
+        render_metrics(&metrics, manager);
+        rendered = true;
+      }
+      serve_metrics(&metrics_clients[i], &metrics);
+    }
+    if ( pfds[1].revents & POLLIN){
+      metrics_accept(metrics_fd, metrics_clients);
+    }
+
+    if ( pfds[0].revents & (POLLIN | POLLHUP)){
+      int result = read_command(server_args);
+      if ( result < 0 && feof(stdin)){
+        stdin_fd = -1; // Keep serving metrics once input is closed
+        continue;
+      }
+      if ( result == 0){
+        run_command(server_args, manager);
+      }
+      display_prompt();
+    }
+  }
+}